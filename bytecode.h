@@ -0,0 +1,197 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "value.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Instruction set of the RUN virtual machine. Every instruction is one
+ * 32-bit word, followed by the operand words noted next to it. */
+typedef enum {
+  OP_LINE,        /* line index: start of a program line */
+  OP_PUSH_NUMBER, /* index into numbers[] */
+  OP_PUSH_INTEGER, /* the value itself */
+  OP_PUSH_STRING, /* index into strings[] */
+  OP_LOAD_NUMBER, /* variable slot */
+  OP_LOAD_INTEGER, /* variable slot */
+  OP_LOAD_STRING, /* variable slot */
+  OP_STORE_NUMBER, /* variable slot */
+  OP_STORE_INTEGER, /* variable slot */
+  OP_STORE_STRING, /* variable slot */
+
+  /* Arrays, named by the slot of their array variable. OP_ELEMENT turns
+   * the subscripts into an index into the elements, which the load or
+   * store that follows takes from the stack. */
+  OP_DIM,     /* variable slot, count of bounds on the stack */
+  OP_ELEMENT, /* variable slot, count of subscripts on the stack */
+  OP_LOAD_ELEMENT_NUMBER,   /* variable slot */
+  OP_LOAD_ELEMENT_INTEGER,  /* variable slot */
+  OP_LOAD_ELEMENT_STRING,   /* variable slot */
+  OP_STORE_ELEMENT_NUMBER,  /* variable slot; the value is above the index */
+  OP_STORE_ELEMENT_INTEGER, /* variable slot; the value is above the index */
+  OP_STORE_ELEMENT_STRING,  /* variable slot; the value is above the index */
+
+  /* Conversions of the value at the given depth below the top */
+  OP_TO_NUMBER,  /* depth */
+  OP_TO_INTEGER, /* depth */
+
+  /* Numeric operators; the compiler has already checked operand types */
+  OP_ADD,
+  OP_SUBTRACT,
+  OP_MULTIPLY,
+  OP_DIVIDE,
+  OP_POWER,
+  OP_NEGATE,
+  OP_EQUAL,
+  OP_NOT_EQUAL,
+  OP_LESS,
+  OP_GREATER,
+  OP_LESS_EQUAL,
+  OP_GREATER_EQUAL,
+
+  /* Integer operators. Operands that overflowed into doubles are still
+   * accepted, and results that do not fit promote to a double. */
+  OP_ADD_INT,
+  OP_SUBTRACT_INT,
+  OP_MULTIPLY_INT,
+  OP_NEGATE_INT,
+  OP_COMPARE_INT, /* relational opcode to apply to the comparison */
+  OP_AND,         /* AND, OR and NOT take converted integer operands */
+  OP_OR,
+  OP_NOT,
+
+  /* String operators */
+  OP_CONCAT, /* count of strings to join, at least 2 */
+  OP_STRING_COMPARE, /* relational opcode to apply to the comparison */
+
+  /* Built-in functions */
+  OP_ABS,
+  OP_INT,
+  OP_RND,
+  OP_SIN,
+  OP_COS,
+  OP_TAN,
+  OP_SQR,
+  OP_PEEK,
+  OP_LEN,
+  OP_VAL,
+  OP_ASC,
+  OP_CHR,
+  OP_STR,
+  OP_LEFT,
+  OP_RIGHT,
+  OP_MID,
+  OP_ER, /* ER and EL take no arguments */
+  OP_EL,
+
+  /* Statements */
+  OP_PRINT_NUMBER,
+  OP_PRINT_STRING,
+  OP_PRINT_TAB,
+  OP_PRINT_NEWLINE,
+  OP_JUMP,          /* target pc, also GOTO to a resolved line */
+  OP_JUMP_IF_FALSE, /* target pc */
+  OP_JUMP_IF_TRUE,  /* target pc */
+  OP_GOTO,          /* computed target line on the stack */
+  OP_GOSUB,         /* computed target line on the stack */
+  OP_CALL,          /* target pc: GOSUB to a line resolved at compile time */
+  OP_RETURN,
+  OP_ON_GOTO,  /* count, then that many target pcs (-1: line not found) */
+  OP_ON_GOSUB, /* count, then that many target pcs (-1: line not found) */
+  OP_READ,    /* 1 to read the next DATA item as a string, 0 as a number */
+  OP_RESTORE, /* line number, or -1 for the first DATA item */
+  OP_TRAP,    /* handler line number, or -1 to turn trapping off */
+  OP_RESUME,  /* ResumeMode */
+  OP_FOR,  /* variable slot; limit and step are on the stack */
+  OP_NEXT, /* variable slot, or -1 for the innermost loop */
+  /* Leaving a DO, WHILE or REPEAT loop ends the FOR loops opened inside
+   * it, as RETURN does for a subroutine: MARK_FOR keeps the FOR depth at
+   * the start of the loop in an integer variable and DROP_FOR goes back
+   * to it */
+  OP_MARK_FOR, /* variable slot */
+  OP_DROP_FOR, /* variable slot */
+  OP_POKE,
+  OP_PLOT,
+  OP_DRAW,
+  OP_CLR,
+  OP_MEMCHK,
+  OP_ERROR, /* index into strings[] holding the message */
+  OP_EXIT,
+  OP_END
+} Opcode;
+
+/* Where RESUME continues. RESUME line is compiled as RESUME_LINE followed
+ * by a jump to the line. */
+typedef enum {
+  RESUME_RETRY, /* The statement that failed */
+  RESUME_NEXT,  /* The statement after it */
+  RESUME_LINE   /* The next instruction */
+} ResumeMode;
+
+struct ProgramLine;
+struct Trace;
+
+/* DATA item, parsed when the program is compiled. Every item can be read
+ * as a string; items that parse as numbers can also be read as one. */
+typedef struct {
+  bool is_number;
+  double number;
+  int string; /* Index into strings[] */
+} DataItem;
+
+/* Code of one program statement, code[start..end). Statements are listed
+ * in the order they finish compiling, so ends never decrease and nested
+ * statements come before the one holding them. Only a trapped error
+ * looks at them. */
+typedef struct {
+  int start;
+  int end;
+} StatementRange;
+
+/* DEF FN function. Calls compile the body in place, so only where to
+ * find it in the crunched program is kept. Names point into that code. */
+typedef struct {
+  const char *name;
+  int name_length;
+  const char *param;
+  int param_length;
+  const uint8_t *code; /* Crunched line holding the DEF */
+  int body;            /* Offset of the body expression in code */
+} FunctionDef;
+
+/* Compiled form of the program plus its constant pools */
+typedef struct {
+  int32_t *code;
+  int length;
+  int capacity;
+  double *numbers;
+  int number_count;
+  int number_capacity;
+  Value *strings; /* Interned, see string_intern() */
+  int string_count;
+  int string_capacity;
+  struct ProgramLine **lines;
+  int line_count;
+  DataItem *data; /* Items of every DATA statement in program order */
+  int data_count;
+  int data_capacity;
+  FunctionDef *functions;
+  int function_count;
+  int function_capacity;
+  StatementRange *statements;
+  int statement_count;
+  int statement_capacity;
+  /* Hot loop tracing, see trace.h */
+  int *back_edges; /* Per program pc: back-edge count or trace state */
+  struct Trace **traces;
+  int trace_count;
+  int trace_capacity;
+  /* Immediate-mode statements are compiled after the program and dropped
+   * again before the next one is compiled */
+  int program_length;
+  int program_numbers;
+  int program_strings;
+  bool valid; /* Program code matches the current listing */
+} Bytecode;
+
+#endif /* BYTECODE_H */
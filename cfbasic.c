@@ -146,7 +146,6 @@ void execute_immediate_command(Interpreter *interp, const char *line) {
 
   switch (token.type) {
   case TOK_LIST: {
-    token_free(&token);
     token = lexer_next_token(&lexer);
 
     int start = 0;
@@ -154,11 +153,9 @@ void execute_immediate_command(Interpreter *interp, const char *line) {
 
     if (token.type == TOK_NUMBER) {
       start = (int)token.number_value;
-      token_free(&token);
       token = lexer_next_token(&lexer);
 
       if (token.type == TOK_COMMA || token.type == TOK_MINUS) {
-        token_free(&token);
         token = lexer_next_token(&lexer);
         if (token.type == TOK_NUMBER) {
           end = (int)token.number_value;
@@ -167,61 +164,59 @@ void execute_immediate_command(Interpreter *interp, const char *line) {
     }
 
     interpreter_list(interp, start, end);
-    token_free(&token);
     break;
   }
 
   case TOK_RUN:
-    token_free(&token);
     interpreter_run(interp);
     break;
 
   case TOK_NEW:
-    token_free(&token);
     interpreter_new(interp);
     break;
 
   case TOK_LOAD: {
-    token_free(&token);
     token = lexer_next_token(&lexer);
 
     if (token.type == TOK_STRING) {
-      interpreter_load(interp, token.text);
+      char *filename = str_duplicate_n(token.text, token.length);
+      if (filename) {
+        interpreter_load(interp, filename);
+        safe_free(filename);
+      }
     } else {
       interp->error_occurred = true;
       interp->error_message = str_duplicate("FILENAME REQUIRED");
     }
-    token_free(&token);
     break;
   }
 
   case TOK_SAVE: {
-    token_free(&token);
     token = lexer_next_token(&lexer);
 
     if (token.type == TOK_STRING) {
-      interpreter_save(interp, token.text);
+      char *filename = str_duplicate_n(token.text, token.length);
+      if (filename) {
+        interpreter_save(interp, filename);
+        safe_free(filename);
+      }
     } else {
       interp->error_occurred = true;
       interp->error_message = str_duplicate("FILENAME REQUIRED");
     }
-    token_free(&token);
     break;
   }
 
   case TOK_EXIT:
     interp->exit_requested = true;
-    token_free(&token);
     break;
 
   case TOK_HELP:
     print_help(interp);
-    token_free(&token);
     break;
 
   case TOK_MEMCHK:
     print_memory_stats(interp);
-    token_free(&token);
     break;
 
   case TOK_CLR:
@@ -230,17 +225,14 @@ void execute_immediate_command(Interpreter *interp, const char *line) {
     } else {
       clear_screen();
     }
-    token_free(&token);
     break;
 
   default:
     /* Execute as direct mode statement */
-    interpreter_execute_line(interp, line);
-    token_free(&token);
+    interpreter_execute_immediate(interp, line);
     break;
   }
 
-  lexer_free(&lexer);
 }
 
 void repl(Interpreter *interp) {
@@ -0,0 +1,1738 @@
+#include "compiler.h"
+#include "lexer.h"
+#include "trace.h"
+#include "utils.h"
+#include "vm.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_EXPRESSION_DEPTH 64
+/* Strings joined by one OP_CONCAT. All but one wait on the VM stack while
+ * the last is computed, so this bounds what each nesting level holds. */
+#define MAX_CONCAT_PARTS 4
+
+/* Jump operand waiting for its target line to be compiled */
+typedef struct {
+  int operand;
+  int line_number;
+  bool in_table; /* Entry of an ON ... GOTO/GOSUB table */
+} Fixup;
+
+/* Open DO, WHILE or REPEAT loop. Its exit jumps are chained through
+ * their operands until the closing statement patches them. */
+typedef struct {
+  TokenType type;
+  int top;   /* pc of the first instruction of the loop */
+  int exits; /* Last exit jump operand, -1 when there is none */
+  int mark;  /* Slot of the FOR depth on entry, see OP_MARK_FOR */
+} Block;
+
+/* Parameter of an inlined FN body. Uses of it either repeat the single
+ * instruction that computed the argument or load the temporary the
+ * argument was stored in. */
+typedef struct {
+  const char *name; /* NULL outside of a function body */
+  int length;
+  int32_t code[2];
+  double number; /* Value of a PUSH_NUMBER argument */
+  int code_length; /* 0 when the argument is in slot */
+  int slot;
+} Binding;
+
+typedef struct {
+  Interpreter *interp;
+  Bytecode *bc;
+  Lexer lexer;
+  Token token;        /* Current lookahead token */
+  int depth;          /* Expression nesting, bounds the VM stack */
+  Fixup *fixups;      /* Literal jump targets resolved after compiling */
+  int fixup_count;
+  int fixup_capacity;
+  Binding binding; /* Parameter of the FN body being compiled */
+  Block *blocks;   /* Loops open at this point, spanning lines */
+  int block_count;
+  int block_capacity;
+  bool in_program;    /* Compiling the listing, not an immediate line */
+  bool error;         /* Current line already ends in OP_ERROR */
+  bool out_of_memory; /* Code or a constant pool could not grow */
+} Compiler;
+
+static bool grow_array(Compiler *c, void **data, int *capacity, int count,
+                       size_t element_size) {
+  if (count < *capacity)
+    return true;
+
+  int new_capacity = *capacity ? *capacity * 2 : 64;
+  void *new_data = safe_realloc(*data, *capacity * element_size,
+                                new_capacity * element_size);
+  if (!new_data) {
+    c->out_of_memory = true;
+    return false;
+  }
+  *data = new_data;
+  *capacity = new_capacity;
+  return true;
+}
+
+/* Append one word. Once the line has failed nothing more is emitted, so
+ * jumps patched later can never land on half-compiled code. */
+static int emit(Compiler *c, int32_t word) {
+  Bytecode *bc = c->bc;
+  if (c->error || c->out_of_memory)
+    return -1;
+  if (!grow_array(c, (void **)&bc->code, &bc->capacity, bc->length,
+                  sizeof(int32_t)))
+    return -1;
+  bc->code[bc->length] = word;
+  return bc->length++;
+}
+
+static void emit_op(Compiler *c, Opcode op) { emit(c, op); }
+
+/* Emit an instruction with one operand; returns the operand's position */
+static int emit_op_arg(Compiler *c, Opcode op, int32_t arg) {
+  emit(c, op);
+  return emit(c, arg);
+}
+
+/* Point a previously emitted jump operand at the current position */
+static void patch(Compiler *c, int operand) {
+  if (operand >= 0) {
+    c->bc->code[operand] = c->bc->length;
+  }
+}
+
+static int add_number(Compiler *c, double value) {
+  Bytecode *bc = c->bc;
+  if (!grow_array(c, (void **)&bc->numbers, &bc->number_capacity,
+                  bc->number_count, sizeof(double)))
+    return 0;
+  bc->numbers[bc->number_count] = value;
+  return bc->number_count++;
+}
+
+static int add_string(Compiler *c, const char *value, int length) {
+  Bytecode *bc = c->bc;
+  if (!grow_array(c, (void **)&bc->strings, &bc->string_capacity,
+                  bc->string_count, sizeof(Value)))
+    return 0;
+  if (!string_intern(c->interp, value, length,
+                     &bc->strings[bc->string_count])) {
+    c->out_of_memory = true;
+    return 0;
+  }
+  return bc->string_count++;
+}
+
+static int variable_slot(Compiler *c, const Token *token) {
+  int slot = var_slot(c->interp, token->text, token->length);
+  if (slot < 0) {
+    c->out_of_memory = true;
+    return 0;
+  }
+  return slot;
+}
+
+/* Arrays are variables named with a trailing (, apart from the plain
+ * variable of the same name */
+static int array_slot(Compiler *c, const Token *token) {
+  char name[255 + 2];
+  int length =
+      snprintf(name, sizeof(name), "%.*s(", token->length, token->text);
+  int slot = var_slot(c->interp, name, length);
+  if (slot < 0) {
+    c->out_of_memory = true;
+    return 0;
+  }
+  return slot;
+}
+
+/* Syntax errors are raised when the statement is reached, as the
+ * token-driven interpreter did, so compiling never rejects a program */
+static void compile_error(Compiler *c, const char *msg) {
+  if (!c->error) {
+    emit_op_arg(c, OP_ERROR, add_string(c, msg, (int)strlen(msg)));
+    c->error = true;
+  }
+}
+
+static void advance(Compiler *c) {
+  c->token = lexer_next_token(&c->lexer);
+}
+
+static bool expect(Compiler *c, TokenType type) {
+  if (c->token.type != type) {
+    compile_error(c, "SYNTAX");
+    return false;
+  }
+  advance(c);
+  return true;
+}
+
+/* Expressions */
+
+/* Static type of an expression. Integer expressions hold an int32 at run
+ * time unless arithmetic overflowed, which promotes them to a double. */
+typedef enum { TYPE_NUMBER, TYPE_INTEGER, TYPE_STRING } ExprType;
+
+/* Binding strength of operators, loosest first */
+enum {
+  PREC_NONE,
+  PREC_OR,
+  PREC_AND,
+  PREC_NOT,
+  PREC_RELATIONAL,
+  PREC_ADDITIVE,
+  PREC_MULTIPLICATIVE,
+  PREC_NEGATE,
+  PREC_POWER
+};
+
+/* Built-in functions. Arguments are N for a number, I for an integer and
+ * S for a string; a lower-case letter marks an argument that may be
+ * omitted. */
+typedef struct {
+  TokenType token;
+  Opcode op;
+  ExprType result;
+  const char *arguments;
+  bool foldable; /* Pure, so constant arguments are evaluated when compiled */
+} Builtin;
+
+static const Builtin builtins[] = {
+    {TOK_ABS, OP_ABS, TYPE_NUMBER, "N", true},
+    {TOK_INT, OP_INT, TYPE_NUMBER, "N", true},
+    {TOK_RND, OP_RND, TYPE_NUMBER, "N", false},
+    {TOK_SIN, OP_SIN, TYPE_NUMBER, "N", true},
+    {TOK_COS, OP_COS, TYPE_NUMBER, "N", true},
+    {TOK_TAN, OP_TAN, TYPE_NUMBER, "N", true},
+    {TOK_SQR, OP_SQR, TYPE_NUMBER, "N", true},
+    {TOK_PEEK, OP_PEEK, TYPE_INTEGER, "I", false},
+    {TOK_LEN, OP_LEN, TYPE_INTEGER, "S", false},
+    {TOK_VAL, OP_VAL, TYPE_NUMBER, "S", false},
+    {TOK_ASC, OP_ASC, TYPE_INTEGER, "S", false},
+    {TOK_CHR, OP_CHR, TYPE_STRING, "I", false},
+    {TOK_STR, OP_STR, TYPE_STRING, "N", false},
+    {TOK_LEFT, OP_LEFT, TYPE_STRING, "SI", false},
+    {TOK_RIGHT, OP_RIGHT, TYPE_STRING, "SI", false},
+    {TOK_MID, OP_MID, TYPE_STRING, "SIi", false},
+};
+
+/* MID$ without a length takes the rest of the string */
+#define REST_OF_STRING INT32_MAX
+
+/* Variable access instructions, indexed by ExprType */
+static const Opcode load_opcodes[] = {OP_LOAD_NUMBER, OP_LOAD_INTEGER,
+                                      OP_LOAD_STRING};
+static const Opcode store_opcodes[] = {OP_STORE_NUMBER, OP_STORE_INTEGER,
+                                       OP_STORE_STRING};
+static const Opcode load_element_opcodes[] = {
+    OP_LOAD_ELEMENT_NUMBER, OP_LOAD_ELEMENT_INTEGER, OP_LOAD_ELEMENT_STRING};
+static const Opcode store_element_opcodes[] = {OP_STORE_ELEMENT_NUMBER,
+                                               OP_STORE_ELEMENT_INTEGER,
+                                               OP_STORE_ELEMENT_STRING};
+
+/* DEF FN name(param) = body */
+static const TokenType def_header[] = {TOK_DEF,        TOK_FN,
+                                       TOK_IDENTIFIER, TOK_LPAREN,
+                                       TOK_IDENTIFIER, TOK_RPAREN,
+                                       TOK_EQUAL};
+#define DEF_HEADER_LENGTH (sizeof(def_header) / sizeof(def_header[0]))
+
+static ExprType compile_expression(Compiler *c);
+static ExprType compile_binary(Compiler *c, int precedence);
+
+static ExprType name_type(const Token *token) {
+  switch (token->length > 0 ? token->text[token->length - 1] : 0) {
+  case '$':
+    return TYPE_STRING;
+  case '%':
+    return TYPE_INTEGER;
+  default:
+    return TYPE_NUMBER;
+  }
+}
+
+static void emit_constant(Compiler *c, const Value *value) {
+  if (value_is_integer(*value)) {
+    emit_op_arg(c, OP_PUSH_INTEGER, value_integer(*value));
+  } else {
+    emit_op_arg(c, OP_PUSH_NUMBER, add_number(c, value->number));
+  }
+}
+
+/* Numeric constant pushed by the instruction at code[at], if it is one */
+static bool constant_at(Compiler *c, int at, Value *value) {
+  const int32_t *code = c->bc->code;
+  if (code[at] == OP_PUSH_INTEGER) {
+    *value = integer_value(code[at + 1]);
+    return true;
+  }
+  if (code[at] == OP_PUSH_NUMBER) {
+    *value = number_value(c->bc->numbers[code[at + 1]]);
+    return true;
+  }
+  return false;
+}
+
+/* Emit a numeric instruction, or evaluate it now if the code from start
+ * is nothing but pushes of its constant operands. Operations that would
+ * fail are left to fail at run time. */
+static void emit_folded(Compiler *c, int start, Opcode op, int arg,
+                        int count) {
+  Bytecode *bc = c->bc;
+  Value operands[2];
+  Value result;
+  bool constant = !c->error && bc->length == start + 2 * count;
+
+  for (int i = 0; constant && i < count; i++) {
+    constant = constant_at(c, start + 2 * i, &operands[i]);
+  }
+  if (constant && vm_fold(op, arg, operands, count, &result)) {
+    /* Reuse the pool entries of operands that were the last ones added */
+    for (int i = count - 1; i >= 0; i--) {
+      if (bc->code[start + 2 * i] == OP_PUSH_NUMBER &&
+          bc->code[start + 2 * i + 1] == bc->number_count - 1) {
+        bc->number_count--;
+      }
+    }
+    bc->length = start;
+    emit_constant(c, &result);
+    return;
+  }
+
+  if (arg >= 0) {
+    emit_op_arg(c, op, arg);
+  } else {
+    emit_op(c, op);
+  }
+}
+
+/* Convert the numeric operand compiled into code[at..end), which sits
+ * depth values below the top of the stack, to the given type. Constants
+ * are converted in place. */
+static void coerce(Compiler *c, int at, int end, int depth, ExprType from,
+                   ExprType to) {
+  Opcode op;
+  Value value, result;
+
+  if (to == TYPE_INTEGER) {
+    op = OP_TO_INTEGER;
+  } else if (from == TYPE_INTEGER) {
+    op = OP_TO_NUMBER;
+  } else {
+    return;
+  }
+  if (c->error)
+    return;
+
+  if (end - at == 2 && constant_at(c, at, &value) &&
+      vm_fold(op, 0, &value, 1, &result)) {
+    if (value_is_integer(result)) {
+      c->bc->code[at] = OP_PUSH_INTEGER;
+      c->bc->code[at + 1] = value_integer(result);
+    } else if (value_is_integer(value)) {
+      c->bc->code[at] = OP_PUSH_NUMBER;
+      c->bc->code[at + 1] = add_number(c, result.number);
+    }
+    return;
+  }
+  emit_op_arg(c, op, depth);
+}
+
+/* Compile an expression and convert it to the type the caller needs */
+static void compile_expression_as(Compiler *c, ExprType type) {
+  int start = c->bc->length;
+  ExprType actual = compile_expression(c);
+  if ((actual == TYPE_STRING) != (type == TYPE_STRING)) {
+    compile_error(c, "TYPE MISMATCH");
+    return;
+  }
+  coerce(c, start, c->bc->length, 0, actual, type);
+}
+
+/* Compile an expression that may be either kind of number */
+static void compile_numeric_expression(Compiler *c) {
+  if (compile_expression(c) == TYPE_STRING) {
+    compile_error(c, "TYPE MISMATCH");
+  }
+}
+
+/* (subscript [, subscript ...]) of the array in slot, ending in op with
+ * the slot and the count of subscripts */
+static void compile_subscripts(Compiler *c, Opcode op, int slot) {
+  if (!expect(c, TOK_LPAREN))
+    return;
+  int depth = c->depth;
+  int count = 0;
+  for (;;) {
+    compile_expression_as(c, TYPE_INTEGER);
+    count++;
+    if (c->token.type != TOK_COMMA)
+      break;
+    advance(c);
+    /* The subscripts so far wait on the VM stack like a left operand */
+    if (++c->depth > MAX_EXPRESSION_DEPTH) {
+      compile_error(c, "FORMULA TOO COMPLEX");
+      break;
+    }
+  }
+  c->depth = depth;
+  if (!expect(c, TOK_RPAREN))
+    return;
+  emit_op_arg(c, op, slot);
+  emit(c, count);
+}
+
+/* Concatenate the operands at start and right, joining two constant
+ * strings at compile time. *parts counts the strings joined by the
+ * OP_CONCAT that ends the left operand, if any; a chain of + then takes
+ * that one instruction, which builds the result in a single pass. */
+static void emit_concat(Compiler *c, int start, int right, int *parts) {
+  Bytecode *bc = c->bc;
+  if (c->error)
+    return;
+  if (*parts > 0 && *parts < MAX_CONCAT_PARTS) {
+    memmove(&bc->code[right - 2], &bc->code[right],
+            (bc->length - right) * sizeof(int32_t));
+    bc->length -= 2;
+    emit_op_arg(c, OP_CONCAT, ++*parts);
+    return;
+  }
+  if (bc->length != start + 4 || bc->code[start] != OP_PUSH_STRING ||
+      bc->code[start + 2] != OP_PUSH_STRING ||
+      bc->code[start + 1] != bc->string_count - 2) {
+    emit_op_arg(c, OP_CONCAT, *parts = 2);
+    return;
+  }
+
+  /* Joined apart from the literals, whose block interning may move */
+  StringHeap *heap = &c->interp->strings;
+  String a = string_get(heap, bc->strings[bc->string_count - 2]);
+  String b = string_get(heap, bc->strings[bc->string_count - 1]);
+  char *s = safe_malloc(a.length + b.length);
+  if (!s) {
+    c->out_of_memory = true;
+    return;
+  }
+  memcpy(s, a.chars, a.length);
+  memcpy(s + a.length, b.chars, b.length);
+  bool interned = string_intern(c->interp, s, a.length + b.length,
+                                &bc->strings[bc->string_count - 2]);
+  safe_free(s);
+  if (!interned) {
+    c->out_of_memory = true;
+    return;
+  }
+  bc->string_count--;
+  bc->length = start + 2;
+}
+
+static ExprType compile_builtin(Compiler *c, const Builtin *fn) {
+  int start = c->bc->length;
+
+  advance(c);
+  if (!expect(c, TOK_LPAREN))
+    return fn->result;
+
+  for (const char *arg = fn->arguments; *arg && !c->error; arg++) {
+    if (arg != fn->arguments) {
+      if (*arg == 'i' && c->token.type == TOK_RPAREN) {
+        emit_op_arg(c, OP_PUSH_INTEGER, REST_OF_STRING);
+        continue;
+      }
+      if (!expect(c, TOK_COMMA))
+        return fn->result;
+    }
+    switch (*arg) {
+    case 'S':
+      compile_expression_as(c, TYPE_STRING);
+      break;
+    case 'N':
+      compile_expression_as(c, TYPE_NUMBER);
+      break;
+    default:
+      compile_expression_as(c, TYPE_INTEGER);
+      break;
+    }
+  }
+  if (!expect(c, TOK_RPAREN))
+    return fn->result;
+
+  if (fn->foldable) {
+    emit_folded(c, start, fn->op, -1, 1);
+  } else {
+    emit_op(c, fn->op);
+  }
+  return fn->result;
+}
+
+static const FunctionDef *find_function(Compiler *c, const Token *name) {
+  for (int i = c->bc->function_count - 1; i >= 0; i--) {
+    const FunctionDef *fn = &c->bc->functions[i];
+    if (fn->name_length == name->length &&
+        str_compare_nocase_n(fn->name, name->text, name->length) == 0)
+      return fn;
+  }
+  return NULL;
+}
+
+static bool is_parameter(Compiler *c, const Token *token) {
+  return c->binding.name && c->binding.length == token->length &&
+         str_compare_nocase_n(c->binding.name, token->text,
+                              token->length) == 0;
+}
+
+static void emit_parameter(Compiler *c, ExprType type) {
+  const int32_t *code = c->binding.code;
+  if (c->binding.code_length && code[0] == OP_PUSH_NUMBER) {
+    /* Every use gets its own pool entry, which folding may then reuse */
+    emit_op_arg(c, OP_PUSH_NUMBER, add_number(c, c->binding.number));
+  } else if (c->binding.code_length) {
+    emit_op_arg(c, (Opcode)code[0], code[1]);
+  } else {
+    emit_op_arg(c, load_opcodes[type], c->binding.slot);
+  }
+}
+
+/* FN name(arg) is inlined: the function's body is compiled in place of
+ * the call with its parameter bound to the argument, so it folds and
+ * runs like the same formula written out. An argument that is a single
+ * instruction is repeated at each use of the parameter; anything else is
+ * evaluated once into a hidden variable. */
+static ExprType compile_call(Compiler *c) {
+  advance(c);
+  if (c->token.type != TOK_IDENTIFIER) {
+    compile_error(c, "SYNTAX");
+    return TYPE_NUMBER;
+  }
+  Token name = c->token;
+  ExprType result = name_type(&name);
+  const FunctionDef *fn = find_function(c, &name);
+  if (!fn) {
+    compile_error(c, "UNDEF'D FUNCTION");
+    return result;
+  }
+  advance(c);
+  if (!expect(c, TOK_LPAREN))
+    return result;
+
+  Binding binding = {fn->param, fn->param_length, {0, 0}, 0, 0, 0};
+  Token param = {TOK_IDENTIFIER, fn->param, fn->param_length, 0, 0, 0};
+  ExprType param_type = name_type(&param);
+  int arg = c->bc->length;
+  compile_expression_as(c, param_type);
+  if (!expect(c, TOK_RPAREN) || c->error)
+    return result;
+
+  if (c->bc->length - arg == 2) {
+    binding.code[0] = c->bc->code[arg];
+    binding.code[1] = c->bc->code[arg + 1];
+    binding.code_length = 2;
+    if (binding.code[0] == OP_PUSH_NUMBER) {
+      binding.number = c->bc->numbers[binding.code[1]];
+      if (binding.code[1] == c->bc->number_count - 1)
+        c->bc->number_count--;
+    }
+    c->bc->length = arg;
+  } else {
+    /* Named so that no program variable can collide with it */
+    char temp[2 * 255 + 2];
+    int length = snprintf(temp, sizeof(temp), "%.*s.%.*s", name.length,
+                          name.text, fn->param_length, fn->param);
+    binding.slot = var_slot(c->interp, temp, length);
+    if (binding.slot < 0) {
+      c->out_of_memory = true;
+      return result;
+    }
+    emit_op_arg(c, store_opcodes[param_type], binding.slot);
+  }
+
+  Lexer saved_lexer = c->lexer;
+  Token saved_token = c->token;
+  Binding saved_binding = c->binding;
+  lexer_init_crunched(&c->lexer, fn->code);
+  c->lexer.position = fn->body;
+  c->token = lexer_next_token(&c->lexer);
+  c->binding = binding;
+
+  int body = c->bc->length;
+  ExprType type = compile_expression(c);
+  if (c->token.type != TOK_EOF && c->token.type != TOK_COLON) {
+    compile_error(c, "SYNTAX");
+  }
+
+  c->lexer = saved_lexer;
+  c->token = saved_token;
+  c->binding = saved_binding;
+
+  if ((type == TYPE_STRING) != (result == TYPE_STRING)) {
+    compile_error(c, "TYPE MISMATCH");
+  } else if (result != TYPE_STRING && type != result) {
+    coerce(c, body, c->bc->length, 0, type, result);
+  }
+  return result;
+}
+
+static ExprType compile_primary(Compiler *c) {
+  ExprType type;
+  double number;
+  Token name;
+
+  switch (c->token.type) {
+  case TOK_NUMBER:
+    /* Whole numbers are integers so integer arithmetic can use them;
+     * they are converted when they meet a double */
+    number = c->token.number_value;
+    if (number == floor(number) && number >= INT32_MIN &&
+        number <= INT32_MAX) {
+      emit_op_arg(c, OP_PUSH_INTEGER, (int32_t)number);
+      type = TYPE_INTEGER;
+    } else {
+      emit_op_arg(c, OP_PUSH_NUMBER, add_number(c, number));
+      type = TYPE_NUMBER;
+    }
+    advance(c);
+    return type;
+  case TOK_STRING:
+    emit_op_arg(c, OP_PUSH_STRING,
+                add_string(c, c->token.text, c->token.length));
+    advance(c);
+    return TYPE_STRING;
+  case TOK_IDENTIFIER:
+    name = c->token;
+    type = name_type(&name);
+    advance(c);
+    if (c->token.type == TOK_LPAREN) {
+      int slot = array_slot(c, &name);
+      compile_subscripts(c, OP_ELEMENT, slot);
+      emit_op_arg(c, load_element_opcodes[type], slot);
+    } else if (is_parameter(c, &name)) {
+      emit_parameter(c, type);
+    } else {
+      emit_op_arg(c, load_opcodes[type], variable_slot(c, &name));
+    }
+    return type;
+  case TOK_FN:
+    return compile_call(c);
+  case TOK_ER:
+  case TOK_EL:
+    emit_op(c, c->token.type == TOK_ER ? OP_ER : OP_EL);
+    advance(c);
+    return TYPE_INTEGER;
+  case TOK_LPAREN:
+    advance(c);
+    type = compile_expression(c);
+    expect(c, TOK_RPAREN);
+    return type;
+  default:
+    break;
+  }
+
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (builtins[i].token == c->token.type)
+      return compile_builtin(c, &builtins[i]);
+  }
+  compile_error(c, "SYNTAX");
+  return TYPE_NUMBER;
+}
+
+/* Prefix operators bind looser than ^ but tighter than the binary
+ * operators, except NOT which applies to a whole comparison */
+static ExprType compile_unary(Compiler *c) {
+  int start = c->bc->length;
+  ExprType type;
+
+  switch (c->token.type) {
+  case TOK_MINUS:
+    advance(c);
+    type = compile_binary(c, PREC_POWER);
+    if (type == TYPE_STRING) {
+      compile_error(c, "TYPE MISMATCH");
+    }
+    emit_folded(c, start, type == TYPE_INTEGER ? OP_NEGATE_INT : OP_NEGATE,
+                -1, 1);
+    return type;
+  case TOK_PLUS:
+    advance(c);
+    type = compile_binary(c, PREC_POWER);
+    if (type == TYPE_STRING) {
+      compile_error(c, "TYPE MISMATCH");
+    }
+    return type;
+  case TOK_NOT:
+    advance(c);
+    type = compile_binary(c, PREC_RELATIONAL);
+    if (type == TYPE_STRING) {
+      compile_error(c, "TYPE MISMATCH");
+    }
+    coerce(c, start, c->bc->length, 0, type, TYPE_INTEGER);
+    emit_folded(c, start, OP_NOT, -1, 1);
+    return TYPE_INTEGER;
+  default:
+    return compile_primary(c);
+  }
+}
+
+static int binary_precedence(TokenType type) {
+  switch (type) {
+  case TOK_OR:
+    return PREC_OR;
+  case TOK_AND:
+    return PREC_AND;
+  case TOK_EQUAL:
+  case TOK_NOT_EQUAL:
+  case TOK_LESS:
+  case TOK_GREATER:
+  case TOK_LESS_EQUAL:
+  case TOK_GREATER_EQUAL:
+    return PREC_RELATIONAL;
+  case TOK_PLUS:
+  case TOK_MINUS:
+    return PREC_ADDITIVE;
+  case TOK_MULTIPLY:
+  case TOK_DIVIDE:
+    return PREC_MULTIPLICATIVE;
+  case TOK_POWER:
+    return PREC_POWER;
+  default:
+    return PREC_NONE;
+  }
+}
+
+static Opcode binary_opcode(TokenType type) {
+  switch (type) {
+  case TOK_OR:
+    return OP_OR;
+  case TOK_AND:
+    return OP_AND;
+  case TOK_EQUAL:
+    return OP_EQUAL;
+  case TOK_NOT_EQUAL:
+    return OP_NOT_EQUAL;
+  case TOK_LESS:
+    return OP_LESS;
+  case TOK_GREATER:
+    return OP_GREATER;
+  case TOK_LESS_EQUAL:
+    return OP_LESS_EQUAL;
+  case TOK_GREATER_EQUAL:
+    return OP_GREATER_EQUAL;
+  case TOK_PLUS:
+    return OP_ADD;
+  case TOK_MINUS:
+    return OP_SUBTRACT;
+  case TOK_MULTIPLY:
+    return OP_MULTIPLY;
+  case TOK_DIVIDE:
+    return OP_DIVIDE;
+  default:
+    return OP_POWER;
+  }
+}
+
+/* Integer form of +, - and *, or OP_END if there is none */
+static Opcode integer_opcode(Opcode op) {
+  switch (op) {
+  case OP_ADD:
+    return OP_ADD_INT;
+  case OP_SUBTRACT:
+    return OP_SUBTRACT_INT;
+  case OP_MULTIPLY:
+    return OP_MULTIPLY_INT;
+  default:
+    return OP_END;
+  }
+}
+
+/* Pick the instruction for a binary operator from its operand types. The
+ * left operand starts at start and the right one at right. parts is kept
+ * for emit_concat(). */
+static ExprType emit_binary(Compiler *c, int start, int right, TokenType token,
+                            ExprType left_type, ExprType right_type,
+                            int *parts) {
+  bool relational = binary_precedence(token) == PREC_RELATIONAL;
+  Opcode op = binary_opcode(token);
+  ExprType type;
+
+  if ((left_type == TYPE_STRING) != (right_type == TYPE_STRING)) {
+    compile_error(c, "TYPE MISMATCH");
+    return TYPE_NUMBER;
+  }
+  if (left_type == TYPE_STRING) {
+    if (op == OP_ADD) {
+      emit_concat(c, start, right, parts);
+      return TYPE_STRING;
+    }
+    *parts = 0;
+    if (!relational) {
+      compile_error(c, "TYPE MISMATCH");
+      return TYPE_NUMBER;
+    }
+    emit_op_arg(c, OP_STRING_COMPARE, op);
+    return TYPE_INTEGER;
+  }
+
+  /* Stay in integers when both sides are; otherwise convert to the
+   * operator's type, right operand first so the left one's extent is
+   * still known */
+  if (left_type == TYPE_INTEGER && right_type == TYPE_INTEGER &&
+      (relational || integer_opcode(op) != OP_END)) {
+    if (relational) {
+      emit_folded(c, start, OP_COMPARE_INT, op, 2);
+    } else {
+      emit_folded(c, start, integer_opcode(op), -1, 2);
+    }
+    return TYPE_INTEGER;
+  }
+
+  type = (op == OP_AND || op == OP_OR) ? TYPE_INTEGER : TYPE_NUMBER;
+  coerce(c, right, c->bc->length, 0, right_type, type);
+  coerce(c, start, right, 1, left_type, type);
+  emit_folded(c, start, op, -1, 2);
+  return relational ? TYPE_INTEGER : type;
+}
+
+/* Precedence climbing: compile an operand, then every following binary
+ * operator that binds at least as tightly as the caller allows. Binary
+ * operators are left-associative, so the right operand must bind
+ * strictly tighter. */
+static ExprType compile_binary(Compiler *c, int precedence) {
+  if (++c->depth > MAX_EXPRESSION_DEPTH) {
+    compile_error(c, "FORMULA TOO COMPLEX");
+    c->depth--;
+    return TYPE_NUMBER;
+  }
+
+  int start = c->bc->length;
+  ExprType left = compile_unary(c);
+  int parts = 0;
+  while (!c->error) {
+    TokenType op = c->token.type;
+    int op_precedence = binary_precedence(op);
+    if (op_precedence == PREC_NONE || op_precedence < precedence)
+      break;
+    advance(c);
+    int right = c->bc->length;
+    ExprType right_type = compile_binary(c, op_precedence + 1);
+    left = emit_binary(c, start, right, op, left, right_type, &parts);
+  }
+
+  c->depth--;
+  return left;
+}
+
+static ExprType compile_expression(Compiler *c) {
+  return compile_binary(c, PREC_OR);
+}
+
+/* Statements */
+static void compile_statements(Compiler *c);
+
+static bool at_statement_end(Compiler *c) {
+  return c->token.type == TOK_EOF || c->token.type == TOK_COLON ||
+         c->token.type == TOK_ELSE;
+}
+
+static void compile_print(Compiler *c) {
+  bool newline = true;
+
+  advance(c);
+  while (!c->error && !at_statement_end(c)) {
+    if (c->token.type == TOK_SEMICOLON) {
+      advance(c);
+      newline = false;
+    } else if (c->token.type == TOK_COMMA) {
+      advance(c);
+      emit_op(c, OP_PRINT_TAB);
+      newline = false;
+    } else {
+      ExprType type = compile_expression(c);
+      emit_op(c, type == TYPE_STRING ? OP_PRINT_STRING : OP_PRINT_NUMBER);
+      newline = true;
+    }
+  }
+
+  if (newline) {
+    emit_op(c, OP_PRINT_NEWLINE);
+  }
+}
+
+static void add_fixup(Compiler *c, int operand, int line_number,
+                      bool in_table) {
+  if (operand >= 0 &&
+      grow_array(c, (void **)&c->fixups, &c->fixup_capacity, c->fixup_count,
+                 sizeof(Fixup))) {
+    c->fixups[c->fixup_count].operand = operand;
+    c->fixups[c->fixup_count].line_number = line_number;
+    c->fixups[c->fixup_count].in_table = in_table;
+    c->fixup_count++;
+  }
+}
+
+/* Compile the target of GOTO/GOSUB. A constant target is bound to the
+ * line's code offset once all lines are compiled; anything else is looked
+ * up through the line index when executed. */
+static void compile_jump_target(Compiler *c, Opcode direct, Opcode computed) {
+  int start = c->bc->length;
+  compile_expression_as(c, TYPE_INTEGER);
+  if (c->error)
+    return;
+
+  Bytecode *bc = c->bc;
+  if (bc->length == start + 2 && bc->code[start] == OP_PUSH_INTEGER) {
+    int line_number = bc->code[start + 1];
+    bc->length = start;
+    add_fixup(c, emit_op_arg(c, direct, 0), line_number, false);
+  } else {
+    emit_op(c, computed);
+  }
+}
+
+/* ON expr GOTO|GOSUB line, line, ... compiles to a table of code offsets
+ * indexed by the value of expr */
+static void compile_on(Compiler *c) {
+  advance(c);
+  compile_expression_as(c, TYPE_INTEGER);
+
+  Opcode op;
+  if (c->token.type == TOK_GOTO) {
+    op = OP_ON_GOTO;
+  } else if (c->token.type == TOK_GOSUB) {
+    op = OP_ON_GOSUB;
+  } else {
+    compile_error(c, "SYNTAX");
+    return;
+  }
+
+  int count = emit_op_arg(c, op, 0);
+  int entries = 0;
+  do {
+    advance(c);
+    if (c->token.type != TOK_NUMBER) {
+      compile_error(c, "SYNTAX");
+      return;
+    }
+    add_fixup(c, emit(c, 0), (int)c->token.number_value, true);
+    entries++;
+    advance(c);
+  } while (c->token.type == TOK_COMMA);
+
+  if (count >= 0) {
+    c->bc->code[count] = entries;
+  }
+}
+
+/* Bind literal jumps to their lines. Jumps to missing lines become the
+ * error GOTO would raise, so they still fail only when reached. */
+static void resolve_fixups(Compiler *c) {
+  for (int i = 0; i < c->fixup_count; i++) {
+    Fixup *f = &c->fixups[i];
+    ProgramLine *target = program_find_line(c->interp, f->line_number);
+    if (target) {
+      c->bc->code[f->operand] = target->code_offset;
+    } else if (f->in_table) {
+      c->bc->code[f->operand] = -1;
+    } else {
+      c->bc->code[f->operand - 1] = OP_ERROR;
+      c->bc->code[f->operand] = add_string(c, "LINE NOT FOUND", 14);
+    }
+  }
+  c->fixup_count = 0;
+}
+
+/* Body of THEN or ELSE: a line number is an implied GOTO */
+static void compile_branch(Compiler *c) {
+  if (c->token.type == TOK_NUMBER) {
+    compile_jump_target(c, OP_JUMP, OP_GOTO);
+  }
+  compile_statements(c);
+}
+
+/* Jump taken when the condition compiled from start is false. A constant
+ * condition needs no test: it becomes an unconditional jump, or nothing
+ * at all, in which case -1 is returned. */
+static int emit_jump_if_false(Compiler *c, int start) {
+  Value value;
+  if (!c->error && c->bc->length == start + 2 &&
+      constant_at(c, start, &value)) {
+    bool truth = value_is_integer(value) ? value_integer(value) != 0
+                                         : value.number != 0;
+    c->bc->length = start;
+    return truth ? -1 : emit_op_arg(c, OP_JUMP, 0);
+  }
+  return emit_op_arg(c, OP_JUMP_IF_FALSE, 0);
+}
+
+/* The false branch is a single jump to the ELSE branch, or past the rest
+ * of the line. Statements of the THEN branch stop at an ELSE, so a
+ * nested IF takes the nearest ELSE and leaves the next one to the
+ * enclosing IF. */
+static void compile_if(Compiler *c) {
+  advance(c);
+  int condition = c->bc->length;
+  compile_numeric_expression(c);
+
+  if (c->token.type == TOK_THEN) {
+    advance(c);
+  } else if (c->token.type != TOK_GOTO) {
+    compile_error(c, "SYNTAX");
+    return;
+  }
+
+  int false_jump = emit_jump_if_false(c, condition);
+  compile_branch(c);
+
+  if (c->token.type == TOK_ELSE && !c->error) {
+    advance(c);
+    int end_jump = emit_op_arg(c, OP_JUMP, 0);
+    patch(c, false_jump);
+    compile_branch(c);
+    patch(c, end_jump);
+  } else {
+    patch(c, false_jump);
+  }
+}
+
+/* The variable or array element named at the current token, as the
+ * target of a store. Returns its slot and sets *store to the instruction
+ * that stores into it; an element's index is left on the stack. */
+static int compile_target(Compiler *c, Opcode *store) {
+  Token name = c->token;
+  ExprType type = name_type(&name);
+  advance(c);
+  if (c->token.type != TOK_LPAREN) {
+    *store = store_opcodes[type];
+    return variable_slot(c, &name);
+  }
+  int slot = array_slot(c, &name);
+  compile_subscripts(c, OP_ELEMENT, slot);
+  *store = store_element_opcodes[type];
+  return slot;
+}
+
+/* = value, stored into slot by op */
+static void compile_store(Compiler *c, ExprType type, Opcode op, int slot) {
+  if (!expect(c, TOK_EQUAL))
+    return;
+  if (type == TYPE_INTEGER) {
+    /* Integer stores convert by themselves */
+    compile_numeric_expression(c);
+  } else {
+    compile_expression_as(c, type);
+  }
+  emit_op_arg(c, op, slot);
+}
+
+static void compile_assignment(Compiler *c) {
+  if (c->token.type != TOK_IDENTIFIER) {
+    compile_error(c, "SYNTAX");
+    return;
+  }
+
+  ExprType type = name_type(&c->token);
+  Opcode store;
+  int slot = compile_target(c, &store);
+  compile_store(c, type, store, slot);
+}
+
+/* FOR var = start TO limit [STEP step]. The loop frame is opened at run
+ * time and its body starts right after OP_FOR. */
+static void compile_for(Compiler *c) {
+  advance(c);
+  if (c->token.type != TOK_IDENTIFIER) {
+    compile_error(c, "SYNTAX");
+    return;
+  }
+  ExprType type = name_type(&c->token);
+  if (type == TYPE_STRING) {
+    compile_error(c, "TYPE MISMATCH");
+    return;
+  }
+
+  /* An array element cannot be one: ( is not = */
+  int slot = variable_slot(c, &c->token);
+  advance(c);
+  compile_store(c, type, store_opcodes[type], slot);
+  if (!expect(c, TOK_TO))
+    return;
+  compile_expression_as(c, type);
+
+  if (c->token.type == TOK_STEP) {
+    advance(c);
+    compile_expression_as(c, type);
+  } else {
+    int start = c->bc->length;
+    emit_op_arg(c, OP_PUSH_INTEGER, 1);
+    coerce(c, start, c->bc->length, 0, TYPE_INTEGER, type);
+  }
+  emit_op_arg(c, OP_FOR, slot);
+}
+
+/* NEXT [var [, var ...]] */
+static void compile_next(Compiler *c) {
+  advance(c);
+  if (c->token.type != TOK_IDENTIFIER) {
+    emit_op_arg(c, OP_NEXT, -1);
+    return;
+  }
+
+  for (;;) {
+    if (c->token.type != TOK_IDENTIFIER) {
+      compile_error(c, "SYNTAX");
+      return;
+    }
+    emit_op_arg(c, OP_NEXT, variable_slot(c, &c->token));
+    advance(c);
+    if (c->token.type != TOK_COMMA)
+      return;
+    advance(c);
+  }
+}
+
+/* Make the line being compiled current again, where a jump from another
+ * line may arrive */
+static void emit_line(Compiler *c) {
+  if (c->in_program) {
+    emit_op_arg(c, OP_LINE, c->bc->line_count - 1);
+  }
+}
+
+/* The depth is marked before the top, so it is kept once per entry to
+ * the loop rather than at every iteration */
+static void open_block(Compiler *c, TokenType type) {
+  if (!grow_array(c, (void **)&c->blocks, &c->block_capacity,
+                  c->block_count, sizeof(Block)))
+    return;
+  /* Blocks at the same nesting level are never open at once, so they
+   * share a variable, named so that no program variable collides */
+  char name[32];
+  int length = snprintf(name, sizeof(name), "LOOP.%d%%", c->block_count);
+  int mark = var_slot(c->interp, name, length);
+  if (mark < 0) {
+    c->out_of_memory = true;
+    return;
+  }
+  emit_op_arg(c, OP_MARK_FOR, mark);
+  Block *block = &c->blocks[c->block_count++];
+  block->type = type;
+  block->top = c->bc->length;
+  block->exits = -1;
+  block->mark = mark;
+  emit_line(c);
+}
+
+/* Add a jump out of the given block, to be patched when it closes */
+static void emit_exit(Compiler *c, int block, Opcode op) {
+  int operand = emit_op_arg(c, op, c->blocks[block].exits);
+  if (operand >= 0) {
+    c->blocks[block].exits = operand;
+  }
+}
+
+static void patch_exits(Compiler *c, const Block *block, int target) {
+  for (int at = block->exits; at >= 0;) {
+    int next = c->bc->code[at];
+    c->bc->code[at] = target;
+    at = next;
+  }
+}
+
+/* Check that the innermost block is the one being closed. The caller
+ * emits the closing jump, then end_block() pops it and patches its exits
+ * to continue after the loop. */
+static bool close_block(Compiler *c, TokenType type, const char *msg) {
+  if (c->block_count == 0 || c->blocks[c->block_count - 1].type != type) {
+    compile_error(c, msg);
+    return false;
+  }
+  return true;
+}
+
+/* Exits land on an OP_DROP_FOR, which the loop also falls through to
+ * when it ends at its closing statement */
+static void end_block(Compiler *c) {
+  const Block *block = &c->blocks[--c->block_count];
+  if (block->exits >= 0) {
+    patch_exits(c, block, c->bc->length);
+    emit_op_arg(c, OP_DROP_FOR, block->mark);
+  }
+  emit_line(c);
+}
+
+/* Blocks still open at the end of the program raise an error when their
+ * loop is left, as there is nowhere to go */
+static void close_open_blocks(Compiler *c) {
+  while (c->block_count > 0) {
+    Block *block = &c->blocks[--c->block_count];
+    if (block->exits >= 0 && !c->out_of_memory) {
+      patch_exits(c, block, c->bc->length);
+      emit_op_arg(c, OP_ERROR, add_string(c, "LOOP NOT FOUND", 14));
+    }
+  }
+}
+
+/* Optional WHILE or UNTIL condition after DO or LOOP. Returns false if
+ * there is none; otherwise the condition is compiled and jumps to target
+ * (or out of the block when target is -1) once the loop should end. */
+static bool compile_loop_condition(Compiler *c, int block, int target) {
+  TokenType type = c->token.type;
+  if (type != TOK_WHILE && type != TOK_UNTIL)
+    return false;
+
+  advance(c);
+  compile_numeric_expression(c);
+  if (target < 0) {
+    emit_exit(c, block, type == TOK_WHILE ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE);
+  } else {
+    emit_op_arg(c, type == TOK_WHILE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE,
+                target);
+  }
+  return true;
+}
+
+/* DO [WHILE|UNTIL cond] ... LOOP [WHILE|UNTIL cond] */
+static void compile_do(Compiler *c) {
+  advance(c);
+  open_block(c, TOK_DO);
+  if (c->block_count > 0) {
+    compile_loop_condition(c, c->block_count - 1, -1);
+  }
+}
+
+static void compile_loop(Compiler *c) {
+  advance(c);
+  if (!close_block(c, TOK_DO, "LOOP WITHOUT DO"))
+    return;
+  int top = c->blocks[c->block_count - 1].top;
+  if (!compile_loop_condition(c, c->block_count - 1, top)) {
+    emit_op_arg(c, OP_JUMP, top);
+  }
+  end_block(c);
+}
+
+/* WHILE cond ... WEND */
+static void compile_while(Compiler *c) {
+  advance(c);
+  open_block(c, TOK_WHILE);
+  if (c->block_count > 0) {
+    compile_numeric_expression(c);
+    emit_exit(c, c->block_count - 1, OP_JUMP_IF_FALSE);
+  }
+}
+
+static void compile_wend(Compiler *c) {
+  advance(c);
+  if (!close_block(c, TOK_WHILE, "WEND WITHOUT WHILE"))
+    return;
+  emit_op_arg(c, OP_JUMP, c->blocks[c->block_count - 1].top);
+  end_block(c);
+}
+
+/* REPEAT ... UNTIL cond */
+static void compile_repeat(Compiler *c) {
+  advance(c);
+  open_block(c, TOK_REPEAT);
+}
+
+static void compile_until(Compiler *c) {
+  advance(c);
+  if (!close_block(c, TOK_REPEAT, "UNTIL WITHOUT REPEAT"))
+    return;
+  compile_numeric_expression(c);
+  emit_op_arg(c, OP_JUMP_IF_FALSE, c->blocks[c->block_count - 1].top);
+  end_block(c);
+}
+
+/* EXIT leaves the innermost loop; outside of one it quits BASIC */
+static void compile_exit(Compiler *c) {
+  advance(c);
+  if (c->block_count > 0) {
+    emit_exit(c, c->block_count - 1, OP_JUMP);
+  } else {
+    emit_op(c, OP_EXIT);
+  }
+}
+
+/* Numeric form of a DATA item, which may be empty to mean zero */
+static bool parse_data_number(const char *text, double *value) {
+  char *end;
+  if (!*text) {
+    *value = 0;
+    return true;
+  }
+  for (const char *p = text; *p; p++) {
+    if (!strchr(NUMBER_CHARS, *p))
+      return false;
+  }
+  *value = strtod(text, &end);
+  return end != text && *end == '\0';
+}
+
+static void add_data(Compiler *c, const char *text, int length, bool quoted) {
+  Bytecode *bc = c->bc;
+  if (!grow_array(c, (void **)&bc->data, &bc->data_capacity, bc->data_count,
+                  sizeof(DataItem)))
+    return;
+  DataItem *item = &bc->data[bc->data_count];
+  item->string = add_string(c, text, length);
+  if (c->out_of_memory)
+    return;
+  item->is_number =
+      !quoted &&
+      parse_data_number(
+          string_get(&c->interp->strings, bc->strings[item->string]).chars,
+          &item->number);
+  bc->data_count++;
+}
+
+/* Parse the items of a DATA statement into the data pool, so READ only
+ * fetches them. DATA typed in immediate mode is never read. */
+static void compile_data(Compiler *c) {
+  const char *p = c->token.text;
+  const char *end = p + c->token.length;
+
+  advance(c);
+  if (!c->in_program)
+    return;
+
+  for (;;) {
+    while (p < end && *p == ' ') {
+      p++;
+    }
+
+    const char *item = p;
+    int length;
+    bool quoted = p < end && *p == '"';
+    if (quoted) {
+      item = ++p;
+      while (p < end && *p != '"') {
+        p++;
+      }
+      length = (int)(p - item);
+      while (p < end && *p != ',') {
+        p++;
+      }
+    } else {
+      while (p < end && *p != ',') {
+        p++;
+      }
+      length = (int)(p - item);
+      while (length > 0 && item[length - 1] == ' ') {
+        length--;
+      }
+    }
+    add_data(c, item, length, quoted);
+
+    if (p >= end)
+      break;
+    p++;
+  }
+}
+
+/* READ var [, var ...], where a var may be an array element */
+static void compile_read(Compiler *c) {
+  do {
+    advance(c);
+    if (c->token.type != TOK_IDENTIFIER) {
+      compile_error(c, "SYNTAX");
+      return;
+    }
+    ExprType type = name_type(&c->token);
+    Opcode store;
+    int slot = compile_target(c, &store);
+    emit_op_arg(c, OP_READ, type == TYPE_STRING);
+    emit_op_arg(c, store, slot);
+  } while (c->token.type == TOK_COMMA);
+}
+
+/* DIM name(bound [, bound ...]) [, name(...) ...] */
+static void compile_dim(Compiler *c) {
+  do {
+    advance(c);
+    if (c->token.type != TOK_IDENTIFIER) {
+      compile_error(c, "SYNTAX");
+      return;
+    }
+    Token name = c->token;
+    advance(c);
+    compile_subscripts(c, OP_DIM, array_slot(c, &name));
+  } while (c->token.type == TOK_COMMA);
+}
+
+/* RESTORE [line] */
+static void compile_restore(Compiler *c) {
+  advance(c);
+  if (c->token.type == TOK_NUMBER) {
+    emit_op_arg(c, OP_RESTORE, (int32_t)c->token.number_value);
+    advance(c);
+  } else {
+    emit_op_arg(c, OP_RESTORE, -1);
+  }
+}
+
+static void compile_trap(Compiler *c) {
+  advance(c);
+  if (c->token.type == TOK_NUMBER) {
+    emit_op_arg(c, OP_TRAP, (int32_t)c->token.number_value);
+    advance(c);
+  } else {
+    emit_op_arg(c, OP_TRAP, -1);
+  }
+}
+
+/* RESUME, RESUME NEXT or RESUME line. Only a program can resume, since
+ * only errors in program lines are trapped. */
+static void compile_resume(Compiler *c) {
+  if (!c->in_program) {
+    compile_error(c, "ILLEGAL DIRECT");
+    return;
+  }
+  advance(c);
+  if (c->token.type == TOK_NEXT) {
+    emit_op_arg(c, OP_RESUME, RESUME_NEXT);
+    advance(c);
+  } else if (at_statement_end(c)) {
+    emit_op_arg(c, OP_RESUME, RESUME_RETRY);
+  } else {
+    emit_op_arg(c, OP_RESUME, RESUME_LINE);
+    compile_jump_target(c, OP_JUMP, OP_GOTO);
+  }
+}
+
+/* Functions are collected before the program is compiled and inlined
+ * where they are called, so DEF only checks its header when executed */
+static void compile_def(Compiler *c) {
+  if (!c->in_program) {
+    compile_error(c, "ILLEGAL DIRECT");
+    return;
+  }
+  for (size_t i = 0; i < DEF_HEADER_LENGTH; i++) {
+    if (!expect(c, def_header[i]))
+      return;
+  }
+  while (!at_statement_end(c)) {
+    advance(c);
+  }
+}
+
+/* Statements of the form KEYWORD expr, expr */
+static void compile_two_arguments(Compiler *c, Opcode op, ExprType type) {
+  advance(c);
+  compile_expression_as(c, type);
+  if (!expect(c, TOK_COMMA))
+    return;
+  compile_expression_as(c, type);
+  emit_op(c, op);
+}
+
+static void compile_simple(Compiler *c, Opcode op) {
+  advance(c);
+  emit_op(c, op);
+}
+
+static void compile_statement(Compiler *c) {
+  switch (c->token.type) {
+  case TOK_PRINT:
+  case TOK_QUESTION:
+    compile_print(c);
+    break;
+  case TOK_IF:
+    compile_if(c);
+    break;
+  case TOK_GOTO:
+    advance(c);
+    compile_jump_target(c, OP_JUMP, OP_GOTO);
+    break;
+  case TOK_GOSUB:
+    advance(c);
+    compile_jump_target(c, OP_CALL, OP_GOSUB);
+    break;
+  case TOK_RETURN:
+    compile_simple(c, OP_RETURN);
+    break;
+  case TOK_ON:
+    compile_on(c);
+    break;
+  case TOK_FOR:
+    compile_for(c);
+    break;
+  case TOK_NEXT:
+    compile_next(c);
+    break;
+  case TOK_LET:
+    advance(c);
+    compile_assignment(c);
+    break;
+  case TOK_IDENTIFIER:
+    compile_assignment(c);
+    break;
+  case TOK_POKE:
+    compile_two_arguments(c, OP_POKE, TYPE_INTEGER);
+    break;
+  case TOK_PLOT:
+    compile_two_arguments(c, OP_PLOT, TYPE_NUMBER);
+    break;
+  case TOK_DRAW:
+    compile_two_arguments(c, OP_DRAW, TYPE_NUMBER);
+    break;
+  case TOK_DO:
+    compile_do(c);
+    break;
+  case TOK_LOOP:
+    compile_loop(c);
+    break;
+  case TOK_WHILE:
+    compile_while(c);
+    break;
+  case TOK_WEND:
+    compile_wend(c);
+    break;
+  case TOK_REPEAT:
+    compile_repeat(c);
+    break;
+  case TOK_UNTIL:
+    compile_until(c);
+    break;
+  case TOK_EXIT:
+    compile_exit(c);
+    break;
+  case TOK_END:
+  case TOK_STOP:
+    compile_simple(c, OP_END);
+    break;
+  case TOK_CLR:
+    compile_simple(c, OP_CLR);
+    break;
+  case TOK_MEMCHK:
+    compile_simple(c, OP_MEMCHK);
+    break;
+  case TOK_DEF:
+    compile_def(c);
+    break;
+  case TOK_DATA:
+    compile_data(c);
+    break;
+  case TOK_READ:
+    compile_read(c);
+    break;
+  case TOK_DIM:
+    compile_dim(c);
+    break;
+  case TOK_RESTORE:
+    compile_restore(c);
+    break;
+  case TOK_TRAP:
+    compile_trap(c);
+    break;
+  case TOK_RESUME:
+    compile_resume(c);
+    break;
+  case TOK_REM:
+    advance(c);
+    break;
+  default:
+    compile_error(c, "SYNTAX");
+    break;
+  }
+}
+
+/* Record where a program statement's code lies, for RESUME */
+static void add_statement(Compiler *c, int start) {
+  Bytecode *bc = c->bc;
+  if (grow_array(c, (void **)&bc->statements, &bc->statement_capacity,
+                 bc->statement_count, sizeof(StatementRange))) {
+    bc->statements[bc->statement_count].start = start;
+    bc->statements[bc->statement_count].end = bc->length;
+    bc->statement_count++;
+  }
+}
+
+/* Compile statements up to the end of the line or an ELSE */
+static void compile_statements(Compiler *c) {
+  while (!c->error) {
+    if (c->token.type == TOK_EOF || c->token.type == TOK_ELSE)
+      return;
+    if (c->token.type == TOK_COLON) {
+      advance(c);
+      continue;
+    }
+    int start = c->bc->length;
+    compile_statement(c);
+    if (c->in_program) {
+      add_statement(c, start);
+    }
+  }
+}
+
+static void compile_line(Compiler *c, const uint8_t *code) {
+  lexer_init_crunched(&c->lexer, code);
+  c->token = lexer_next_token(&c->lexer);
+  c->depth = 0;
+
+  compile_statements(c);
+  if (c->token.type == TOK_ELSE) {
+    compile_error(c, "SYNTAX");
+  }
+
+  c->error = false;
+}
+
+/* Record every well-formed DEF FN, so functions can be called from lines
+ * before their definition as long as it is in the program */
+static void collect_functions(Compiler *c) {
+  Bytecode *bc = c->bc;
+  bc->function_count = 0;
+
+  for (ProgramLine *line = c->interp->program; line; line = line->next) {
+    Lexer lexer;
+    lexer_init_crunched(&lexer, line->code);
+    for (Token token = lexer_next_token(&lexer); token.type != TOK_EOF;
+         token = lexer_next_token(&lexer)) {
+      if (token.type != TOK_DEF)
+        continue;
+
+      Token header[DEF_HEADER_LENGTH];
+      size_t i;
+      for (i = 1; i < DEF_HEADER_LENGTH; i++) {
+        header[i] = lexer_next_token(&lexer);
+        if (header[i].type != def_header[i])
+          break;
+      }
+      if (i < DEF_HEADER_LENGTH ||
+          !grow_array(c, (void **)&bc->functions, &bc->function_capacity,
+                      bc->function_count, sizeof(FunctionDef)))
+        continue;
+
+      FunctionDef *fn = &bc->functions[bc->function_count++];
+      fn->name = header[2].text;
+      fn->name_length = header[2].length;
+      fn->param = header[4].text;
+      fn->param_length = header[4].length;
+      fn->code = line->code;
+      fn->body = lexer.position;
+    }
+  }
+}
+
+static void compiler_init(Compiler *c, Interpreter *interp) {
+  c->interp = interp;
+  c->bc = &interp->bytecode;
+  c->token.type = TOK_EOF;
+  c->depth = 0;
+  c->fixups = NULL;
+  c->fixup_count = 0;
+  c->fixup_capacity = 0;
+  c->in_program = false;
+  c->binding.name = NULL;
+  c->blocks = NULL;
+  c->block_count = 0;
+  c->block_capacity = 0;
+  c->error = false;
+  c->out_of_memory = false;
+}
+
+/* Drop constants above the given pool sizes. Strings stay interned until
+ * the literal block fills up and nothing refers to them. */
+static void bytecode_truncate(Bytecode *bc, int length, int numbers,
+                              int strings) {
+  bc->string_count = strings;
+  bc->number_count = numbers;
+  bc->length = length;
+}
+
+bool compile_program(Interpreter *interp) {
+  Bytecode *bc = &interp->bytecode;
+  if (bc->valid)
+    return true;
+
+  bytecode_truncate(bc, 0, 0, 0);
+  safe_free(bc->lines);
+  bc->lines = NULL;
+  bc->line_count = 0;
+  bc->data_count = 0;
+  bc->statement_count = 0;
+  interp->data_pointer = 0;
+  /* Where to RESUME no longer exists */
+  interp->trapped = false;
+
+  int count = 0;
+  for (ProgramLine *line = interp->program; line; line = line->next) {
+    count++;
+  }
+  bc->lines = safe_malloc((count ? count : 1) * sizeof(ProgramLine *));
+  if (!bc->lines)
+    return false;
+
+  Compiler c;
+  compiler_init(&c, interp);
+  c.in_program = true;
+  collect_functions(&c);
+
+  for (ProgramLine *line = interp->program; line; line = line->next) {
+    line->code_offset = bc->length;
+    line->data_index = bc->data_count;
+    bc->lines[bc->line_count] = line;
+    emit_op_arg(&c, OP_LINE, bc->line_count++);
+    compile_line(&c, line->code);
+  }
+  emit_op(&c, OP_END);
+  close_open_blocks(&c);
+  resolve_fixups(&c);
+  safe_free(c.fixups);
+  safe_free(c.blocks);
+
+  if (c.out_of_memory) {
+    bytecode_truncate(bc, 0, 0, 0);
+    return false;
+  }
+
+  bc->program_length = bc->length;
+  bc->program_numbers = bc->number_count;
+  bc->program_strings = bc->string_count;
+  trace_reset(bc);
+  bc->valid = true;
+  return true;
+}
+
+int compile_immediate(Interpreter *interp, const uint8_t *code) {
+  Bytecode *bc = &interp->bytecode;
+  if (!compile_program(interp))
+    return -1;
+
+  bytecode_truncate(bc, bc->program_length, bc->program_numbers,
+                    bc->program_strings);
+
+  Compiler c;
+  compiler_init(&c, interp);
+
+  int entry = bc->length;
+  compile_line(&c, code);
+  emit_op(&c, OP_END);
+  close_open_blocks(&c);
+  resolve_fixups(&c);
+  safe_free(c.fixups);
+  safe_free(c.blocks);
+
+  if (c.out_of_memory) {
+    bytecode_truncate(bc, bc->program_length, bc->program_numbers,
+                      bc->program_strings);
+    return -1;
+  }
+  return entry;
+}
+
+void bytecode_free(Bytecode *bc) {
+  bytecode_truncate(bc, 0, 0, 0);
+  safe_free(bc->code);
+  safe_free(bc->numbers);
+  safe_free(bc->strings);
+  safe_free(bc->lines);
+  safe_free(bc->data);
+  safe_free(bc->functions);
+  safe_free(bc->statements);
+  trace_free(bc);
+  memset(bc, 0, sizeof(*bc));
+}
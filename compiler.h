@@ -0,0 +1,17 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include "bytecode.h"
+#include "interpreter.h"
+
+/* Compile the program listing into interp->bytecode. The result is kept
+ * until the listing changes, so repeated RUNs do not recompile. */
+bool compile_program(Interpreter *interp);
+
+/* Compile one crunched immediate-mode line behind the program code.
+ * Returns the entry pc, or -1 if the compiler ran out of memory. */
+int compile_immediate(Interpreter *interp, const uint8_t *code);
+
+void bytecode_free(Bytecode *bc);
+
+#endif /* COMPILER_H */
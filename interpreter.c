@@ -1,8 +1,10 @@
 #define _GNU_SOURCE
 #include "interpreter.h"
+#include "compiler.h"
 #include "editor.h"
 #include "lexer.h"
 #include "utils.h"
+#include "vm.h"
 #include <ctype.h>
 #include <math.h>
 #include <stdarg.h>
@@ -11,7 +13,7 @@
 #include <string.h>
 #include <time.h>
 
-static void basic_print(Interpreter *interp, const char *format, ...) {
+void basic_print(Interpreter *interp, const char *format, ...) {
   va_list args;
   va_start(args, format);
   char *buf = NULL;
@@ -27,7 +29,7 @@ static void basic_print(Interpreter *interp, const char *format, ...) {
   va_end(args);
 }
 
-static void interpreter_error(Interpreter *interp, const char *msg) {
+void interpreter_error(Interpreter *interp, const char *msg) {
   interp->error_occurred = true;
   if (interp->error_message) {
     safe_free(interp->error_message);
@@ -35,12 +37,26 @@ static void interpreter_error(Interpreter *interp, const char *msg) {
   interp->error_message = str_duplicate(msg);
 }
 
+static void clear_trap(Interpreter *interp) {
+  interp->trap_line = -1;
+  interp->trapped = false;
+  interp->error_number = -1;
+  interp->error_line = -1;
+}
+
 void interpreter_init(Interpreter *interp) {
   interp->program = NULL;
+  memset(&interp->line_index, 0, sizeof(interp->line_index));
   interp->current_line = NULL;
-  interp->variables = NULL;
+  memset(&interp->variables, 0, sizeof(interp->variables));
+  memset(&interp->strings, 0, sizeof(interp->strings));
   interp->call_stack = NULL;
-  interp->for_stack = NULL;
+  interp->call_depth = 0;
+  interp->call_capacity = 0;
+  interp->for_depth = 0;
+  interp->data_pointer = 0;
+  clear_trap(interp);
+  memset(&interp->bytecode, 0, sizeof(interp->bytecode));
   interp->editor = NULL; // Initialize
   interp->running = false;
   interp->break_requested = false;
@@ -55,20 +71,95 @@ void interpreter_init(Interpreter *interp) {
   srand(time(NULL));
 }
 
+static void clear_stacks(Interpreter *interp) {
+  interp->call_depth = 0;
+
+  interp->for_depth = 0;
+}
+
 void interpreter_free(Interpreter *interp) {
   program_clear(interp);
   var_clear_all(interp);
+  string_heap_free(&interp->strings);
+  clear_stacks(interp);
+  bytecode_free(&interp->bytecode);
+  safe_free(interp->call_stack);
+  interp->call_stack = NULL;
+  interp->call_capacity = 0;
+  safe_free(interp->line_index.slots);
 
-  while (interp->call_stack) {
-    stack_pop(interp);
+  if (interp->error_message) {
+    safe_free(interp->error_message);
   }
+}
+
+/* Line number index */
+static unsigned line_hash(const LineIndex *index, int line_num) {
+  return ((unsigned)line_num * 2654435761u) & (index->capacity - 1);
+}
 
-  while (interp->for_stack) {
-    for_pop(interp);
+static bool line_index_grow(LineIndex *index) {
+  int new_capacity = index->capacity ? index->capacity * 2 : 64;
+  ProgramLine **slots = safe_malloc(new_capacity * sizeof(ProgramLine *));
+  if (!slots)
+    return false;
+  memset(slots, 0, new_capacity * sizeof(ProgramLine *));
+
+  ProgramLine **old_slots = index->slots;
+  int old_capacity = index->capacity;
+  index->slots = slots;
+  index->capacity = new_capacity;
+
+  for (int i = 0; i < old_capacity; i++) {
+    if (old_slots[i]) {
+      unsigned h = line_hash(index, old_slots[i]->line_number);
+      while (slots[h]) {
+        h = (h + 1) & (new_capacity - 1);
+      }
+      slots[h] = old_slots[i];
+    }
   }
+  safe_free(old_slots);
+  return true;
+}
 
-  if (interp->error_message) {
-    safe_free(interp->error_message);
+static bool line_index_insert(LineIndex *index, ProgramLine *line) {
+  /* Keep the load factor at or below one half */
+  if ((index->count + 1) * 2 > index->capacity && !line_index_grow(index))
+    return false;
+
+  unsigned h = line_hash(index, line->line_number);
+  while (index->slots[h]) {
+    h = (h + 1) & (index->capacity - 1);
+  }
+  index->slots[h] = line;
+  index->count++;
+  return true;
+}
+
+static void line_index_remove(LineIndex *index, int line_num) {
+  if (!index->count)
+    return;
+
+  unsigned mask = index->capacity - 1;
+  unsigned h = line_hash(index, line_num);
+  while (index->slots[h] && index->slots[h]->line_number != line_num) {
+    h = (h + 1) & mask;
+  }
+  if (!index->slots[h])
+    return;
+
+  /* Backward-shift deletion keeps every probe chain unbroken */
+  index->slots[h] = NULL;
+  index->count--;
+  for (unsigned i = (h + 1) & mask; index->slots[i]; i = (i + 1) & mask) {
+    ProgramLine *line = index->slots[i];
+    unsigned home = line_hash(index, line->line_number);
+    if (((i - home) & mask) >= ((i - h) & mask)) {
+      index->slots[h] = line;
+      index->slots[i] = NULL;
+      h = i;
+    }
   }
 }
 
@@ -82,12 +173,32 @@ void program_add_line(Interpreter *interp, int line_num, const char *text) {
     return;
   }
 
+  /* Crunch once so RUN never has to lex the text again */
+  int code_length;
+  uint8_t *code = lexer_crunch(text, &code_length);
+  if (!code) {
+    return;
+  }
+
   /* Create new line */
   ProgramLine *new_line = safe_malloc(sizeof(ProgramLine));
+  if (!new_line) {
+    safe_free(code);
+    return;
+  }
   new_line->line_number = line_num;
-  new_line->text = str_duplicate(text);
+  new_line->code = code;
+  new_line->code_length = code_length;
   new_line->next = NULL;
 
+  if (!line_index_insert(&interp->line_index, new_line)) {
+    safe_free(code);
+    safe_free(new_line);
+    return;
+  }
+
+  interp->bytecode.valid = false;
+
   /* Insert in sorted order */
   if (!interp->program || interp->program->line_number > line_num) {
     new_line->next = interp->program;
@@ -103,13 +214,17 @@ void program_add_line(Interpreter *interp, int line_num, const char *text) {
 }
 
 void program_delete_line(Interpreter *interp, int line_num) {
-  if (!interp->program)
+  /* Entering a new line number needs no walk of the listing */
+  if (!program_find_line(interp, line_num))
     return;
 
+  interp->bytecode.valid = false;
+  line_index_remove(&interp->line_index, line_num);
+
   if (interp->program->line_number == line_num) {
     ProgramLine *temp = interp->program;
     interp->program = interp->program->next;
-    safe_free(temp->text);
+    safe_free(temp->code);
     safe_free(temp);
     return;
   }
@@ -119,7 +234,7 @@ void program_delete_line(Interpreter *interp, int line_num) {
     if (current->next->line_number == line_num) {
       ProgramLine *temp = current->next;
       current->next = temp->next;
-      safe_free(temp->text);
+      safe_free(temp->code);
       safe_free(temp);
       return;
     }
@@ -128,149 +243,206 @@ void program_delete_line(Interpreter *interp, int line_num) {
 }
 
 ProgramLine *program_find_line(Interpreter *interp, int line_num) {
-  ProgramLine *current = interp->program;
-  while (current) {
-    if (current->line_number == line_num) {
-      return current;
+  const LineIndex *index = &interp->line_index;
+  if (!index->count)
+    return NULL;
+
+  unsigned h = line_hash(index, line_num);
+  while (index->slots[h]) {
+    if (index->slots[h]->line_number == line_num) {
+      return index->slots[h];
     }
-    if (current->line_number > line_num) {
-      return NULL;
-    }
-    current = current->next;
+    h = (h + 1) & (index->capacity - 1);
   }
   return NULL;
 }
 
 void program_clear(Interpreter *interp) {
+  interp->bytecode.valid = false;
   while (interp->program) {
     ProgramLine *temp = interp->program;
     interp->program = interp->program->next;
-    safe_free(temp->text);
+    safe_free(temp->code);
     safe_free(temp);
   }
+
+  if (interp->line_index.slots) {
+    memset(interp->line_index.slots, 0,
+           interp->line_index.capacity * sizeof(ProgramLine *));
+  }
+  interp->line_index.count = 0;
 }
 
 /* Variable management */
-Variable *var_get(Interpreter *interp, const char *name) {
-  Variable *current = interp->variables;
-  while (current) {
-    if (str_compare_nocase(current->name, name) == 0) {
-      return current;
-    }
-    current = current->next;
+static unsigned var_hash(const char *name, int length) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    h = (h ^ (unsigned)toupper((unsigned char)name[i])) * 16777619u;
   }
-  return NULL;
+  return h;
 }
 
-Variable *var_set_number(Interpreter *interp, const char *name, double value) {
-  Variable *var = var_get(interp, name);
+static bool var_name_equals(const Variable *var, const char *name,
+                            int length) {
+  return str_compare_nocase_n(var->name, name, length) == 0 &&
+         var->name[length] == '\0';
+}
 
-  if (!var) {
-    var = safe_malloc(sizeof(Variable));
-    var->name = str_duplicate(name);
-    var->type = VAR_NUMBER;
-    var->value.number = value;
-    var->next = interp->variables;
-    interp->variables = var;
-  } else {
-    if (var->type == VAR_STRING && var->value.string) {
-      safe_free(var->value.string);
-    }
-    var->type = VAR_NUMBER;
-    var->value.number = value;
+/* Bucket holding name's slot, or the empty bucket where it would go */
+static int *var_bucket(VariableTable *table, const char *name, int length) {
+  unsigned mask = table->bucket_count - 1;
+  unsigned h = var_hash(name, length) & mask;
+  while (table->buckets[h] >= 0 &&
+         !var_name_equals(table->slots[table->buckets[h]], name, length)) {
+    h = (h + 1) & mask;
   }
+  return &table->buckets[h];
+}
+
+static bool var_table_grow(VariableTable *table) {
+  int new_capacity = table->capacity ? table->capacity * 2 : 32;
+  Variable **slots =
+      safe_realloc(table->slots, table->capacity * sizeof(Variable *),
+                   new_capacity * sizeof(Variable *));
+  if (!slots)
+    return false;
+  table->slots = slots;
+  table->capacity = new_capacity;
 
-  return var;
+  /* Keep the hash at most half full */
+  int *buckets = safe_malloc(new_capacity * 2 * sizeof(int));
+  if (!buckets)
+    return false;
+  safe_free(table->buckets);
+  table->buckets = buckets;
+  table->bucket_count = new_capacity * 2;
+  for (int i = 0; i < table->bucket_count; i++) {
+    buckets[i] = -1;
+  }
+  for (int i = 0; i < table->count; i++) {
+    const char *name = table->slots[i]->name;
+    *var_bucket(table, name, (int)strlen(name)) = i;
+  }
+  return true;
 }
 
-Variable *var_set_string(Interpreter *interp, const char *name,
-                         const char *value) {
-  Variable *var = var_get(interp, name);
+/* Find or create the slot for name; -1 if out of memory. New variables
+ * start out as 0 or the empty string depending on the name, and a name
+ * ending in ( is an array that has no elements yet. */
+int var_slot(Interpreter *interp, const char *name, int length) {
+  VariableTable *table = &interp->variables;
+  if (table->count) {
+    int slot = *var_bucket(table, name, length);
+    if (slot >= 0)
+      return slot;
+  }
+
+  if (table->count == table->capacity && !var_table_grow(table))
+    return -1;
 
-  if (!var) {
-    var = safe_malloc(sizeof(Variable));
-    var->name = str_duplicate(name);
+  Variable *var = safe_malloc(sizeof(Variable));
+  if (!var)
+    return -1;
+  var->name = str_duplicate_n(name, length);
+  if (!var->name) {
+    safe_free(var);
+    return -1;
+  }
+  if (name[length - 1] == '(') {
+    /* Arrays have names of their own, so A and A() are different */
+    char suffix = length > 1 ? name[length - 2] : 0;
+    var->type = suffix == '$'   ? VAR_ARRAY_STRING
+                : suffix == '%' ? VAR_ARRAY_INTEGER
+                                : VAR_ARRAY_NUMBER;
+    var->value.array = NULL;
+  } else if (name[length - 1] == '$') {
     var->type = VAR_STRING;
-    var->value.string = str_duplicate(value);
-    var->next = interp->variables;
-    interp->variables = var;
+    var->value.string = string_value(VALUE_STRING_TAG, 0, 0);
+  } else if (name[length - 1] == '%') {
+    var->type = VAR_INTEGER;
+    var->value.integer = 0;
   } else {
-    if (var->type == VAR_STRING && var->value.string) {
-      safe_free(var->value.string);
-    }
-    var->type = VAR_STRING;
-    var->value.string = str_duplicate(value);
+    var->type = VAR_NUMBER;
+    var->value.number = 0;
   }
 
-  return var;
+  int slot = table->count++;
+  table->slots[slot] = var;
+  *var_bucket(table, name, length) = slot;
+  return slot;
 }
 
-void var_clear_all(Interpreter *interp) {
-  while (interp->variables) {
-    Variable *temp = interp->variables;
-    interp->variables = interp->variables->next;
+static bool is_array(const Variable *var) {
+  return var->type == VAR_ARRAY_NUMBER || var->type == VAR_ARRAY_INTEGER ||
+         var->type == VAR_ARRAY_STRING;
+}
 
-    if (temp->type == VAR_STRING && temp->value.string) {
-      safe_free(temp->value.string);
+/* Undo every DIM, so that a program run again can DIM its arrays again */
+void var_clear_arrays(Interpreter *interp) {
+  VariableTable *table = &interp->variables;
+  for (int i = 0; i < table->count; i++) {
+    Variable *var = table->slots[i];
+    if (is_array(var) && var->value.array) {
+      safe_free(var->value.array);
+      var->value.array = NULL;
+      /* Traces hold on to the arrays they index */
+      interp->bytecode.valid = false;
     }
-    safe_free(temp->name);
-    safe_free(temp);
   }
 }
 
-/* Stack management for GOSUB/RETURN */
-void stack_push(Interpreter *interp, int return_line) {
-  StackFrame *frame = safe_malloc(sizeof(StackFrame));
-  frame->return_line = return_line;
-  frame->next = interp->call_stack;
-  interp->call_stack = frame;
-}
-
-int stack_pop(Interpreter *interp) {
-  if (!interp->call_stack) {
-    interpreter_error(interp, "RETURN WITHOUT GOSUB");
-    return 0; // Return a dummy value, as error will stop execution
+void var_clear_all(Interpreter *interp) {
+  VariableTable *table = &interp->variables;
+  for (int i = 0; i < table->count; i++) {
+    Variable *var = table->slots[i];
+    if (is_array(var)) {
+      safe_free(var->value.array);
+    }
+    safe_free(var->name);
+    safe_free(var);
   }
+  safe_free(table->slots);
+  safe_free(table->buckets);
+  memset(table, 0, sizeof(*table));
+  string_heap_clear(&interp->strings);
 
-  StackFrame *frame = interp->call_stack;
-  int return_line = frame->return_line;
-  interp->call_stack = frame->next;
-  safe_free(frame);
-
-  return return_line;
-}
-
-/* FOR loop management */
-void for_push(Interpreter *interp, const char *var_name, double end,
-              double step, int line) {
-  ForLoop *loop = safe_malloc(sizeof(ForLoop));
-  loop->var_name = str_duplicate(var_name);
-  loop->end_value = end;
-  loop->step_value = step;
-  loop->loop_line = line;
-  loop->next = interp->for_stack;
-  interp->for_stack = loop;
+  /* Compiled code refers to variables by slot */
+  interp->bytecode.valid = false;
 }
 
-ForLoop *for_find(Interpreter *interp, const char *var_name) {
-  ForLoop *current = interp->for_stack;
-  while (current) {
-    if (str_compare_nocase(current->var_name, var_name) == 0) {
-      return current;
+/* Stack management for GOSUB/RETURN */
+bool stack_push(Interpreter *interp, int return_pc) {
+  if (interp->call_depth == interp->call_capacity) {
+    int capacity = interp->call_capacity ? interp->call_capacity * 2 : 64;
+    StackFrame *frames =
+        safe_realloc(interp->call_stack,
+                     interp->call_capacity * sizeof(StackFrame),
+                     capacity * sizeof(StackFrame));
+    if (!frames) {
+      interpreter_error(interp, "OUT OF MEMORY");
+      return false;
     }
-    current = current->next;
+    interp->call_stack = frames;
+    interp->call_capacity = capacity;
   }
-  return NULL;
+
+  StackFrame *frame = &interp->call_stack[interp->call_depth++];
+  frame->line = interp->current_line;
+  frame->return_pc = return_pc;
+  frame->for_depth = interp->for_depth;
+  return true;
 }
 
-void for_pop(Interpreter *interp) {
-  if (!interp->for_stack)
-    return;
+int stack_pop(Interpreter *interp) {
+  if (interp->call_depth == 0) {
+    interpreter_error(interp, "RETURN WITHOUT GOSUB");
+    return 0; // Return a dummy value, as error will stop execution
+  }
 
-  ForLoop *loop = interp->for_stack;
-  interp->for_stack = loop->next;
-  safe_free(loop->var_name);
-  safe_free(loop);
+  StackFrame *frame = &interp->call_stack[--interp->call_depth];
+  interp->current_line = frame->line;
+  interp->for_depth = frame->for_depth;
+  return frame->return_pc;
 }
 
 /* Interpreter commands */
@@ -280,7 +452,11 @@ void interpreter_list(Interpreter *interp, int start, int end) {
   while (current) {
     if (current->line_number >= start &&
         (end == -1 || current->line_number <= end)) {
-      basic_print(interp, "%d %s\n", current->line_number, current->text);
+      char *text = lexer_detokenize(current->code);
+      if (text) {
+        basic_print(interp, "%d %s\n", current->line_number, text);
+        safe_free(text);
+      }
     }
     current = current->next;
   }
@@ -289,14 +465,8 @@ void interpreter_list(Interpreter *interp, int start, int end) {
 void interpreter_new(Interpreter *interp) {
   program_clear(interp);
   var_clear_all(interp);
-
-  while (interp->call_stack) {
-    stack_pop(interp);
-  }
-
-  while (interp->for_stack) {
-    for_pop(interp);
-  }
+  clear_stacks(interp);
+  clear_trap(interp);
 }
 
 bool interpreter_load(Interpreter *interp, const char *filename) {
@@ -337,7 +507,11 @@ bool interpreter_save(Interpreter *interp, const char *filename) {
 
   ProgramLine *current = interp->program;
   while (current) {
-    fprintf(file, "%d %s\n", current->line_number, current->text);
+    char *text = lexer_detokenize(current->code);
+    if (text) {
+      fprintf(file, "%d %s\n", current->line_number, text);
+      safe_free(text);
+    }
     current = current->next;
   }
 
@@ -345,526 +519,61 @@ bool interpreter_save(Interpreter *interp, const char *filename) {
   return true;
 }
 
+/* Print an error raised while a program line was executing */
+static void report_program_error(Interpreter *interp) {
+  if (interp->error_message) {
+    basic_print(interp, "?%s ERROR IN %d\n", interp->error_message,
+                interp->current_line->line_number);
+    safe_free(interp->error_message);
+    interp->error_message = NULL;
+  } else {
+    basic_print(interp, "?ERROR IN %d\n", interp->current_line->line_number);
+  }
+  interp->error_occurred = false;
+}
+
 void interpreter_run(Interpreter *interp) {
   if (!interp->program) {
     return;
   }
 
-  interp->running = true;
-  interp->current_line = interp->program;
-
-  while (interp->running && interp->current_line) {
-    if (interp->break_requested) {
-      basic_print(interp, "\n? BREAK\n");
-      interp->break_requested = false;
-      interp->running = false;
-      break;
-    }
-
-    ProgramLine *executing_line = interp->current_line;
-    interpreter_execute_line(interp, executing_line->text);
-
-    if (interp->error_occurred) {
-      if (interp->error_message) {
-        basic_print(interp, "?%s ERROR IN %d\n", interp->error_message,
-                    executing_line->line_number);
-        safe_free(interp->error_message);
-        interp->error_message = NULL;
-      } else {
-        basic_print(interp, "?ERROR IN %d\n", executing_line->line_number);
-      }
-      interp->running = false;
-      interp->error_occurred = false;
-      break;
-    }
-
-    /* Advance if execution didn't change current_line */
-    if (interp->running && interp->current_line == executing_line) {
-      interp->current_line = executing_line->next;
-    }
+  var_clear_arrays(interp);
+  if (!compile_program(interp)) {
+    interpreter_error(interp, "OUT OF MEMORY");
+    return;
   }
 
-  interp->running = false;
-}
-
-/* Very basic value structure for expressions */
-typedef struct {
-  bool is_string;
-  double number;
-  char *string;
-} Value;
-
-Value evaluate_expression(Interpreter *interp, Lexer *lexer);
-
-Value evaluate_factor(Interpreter *interp, Lexer *lexer) {
-  Token token = lexer_next_token(lexer);
-  Value val = {false, 0, NULL};
-
-  if (token.type == TOK_NUMBER) {
-    val.is_string = false;
-    val.number = token.number_value;
-  } else if (token.type == TOK_STRING) {
-    val.is_string = true;
-    val.string = str_duplicate(token.text);
-  } else if (token.type == TOK_IDENTIFIER) {
-    Variable *v = var_get(interp, token.text);
-    if (v) {
-      if (v->type == VAR_NUMBER) {
-        val.is_string = false;
-        val.number = v->value.number;
-      } else if (v->type == VAR_STRING) {
-        val.is_string = true;
-        val.string = str_duplicate(v->value.string);
-      }
-    } else {
-      // Default to 0 or empty string if not found
-      if (token.text && token.text[strlen(token.text) - 1] == '$') {
-        val.is_string = true;
-        val.string = str_duplicate("");
-      } else {
-        val.is_string = false;
-        val.number = 0;
-      }
-    }
-  } else if (token.type == TOK_LPAREN) {
-    token_free(&token);
-    val = evaluate_expression(interp, lexer);
-    Token rparen = lexer_next_token(lexer);
-    token_free(&rparen);
-    return val;
-  } else if (token.type == TOK_CHR) {
-    token_free(&token);
-    Token lparen = lexer_next_token(lexer);
-    token_free(&lparen);
-    Value v = evaluate_expression(interp, lexer);
-    Token rparen = lexer_next_token(lexer);
-    token_free(&rparen);
-
-    val.is_string = true;
-    char buf[2] = {(char)v.number, 0};
-    val.string = str_duplicate(buf);
-    if (v.is_string)
-      safe_free(v.string);
-  } else if (token.type == TOK_PEEK) {
-    token_free(&token);
-    Token lparen = lexer_next_token(lexer);
-    token_free(&lparen);
-    Value v = evaluate_expression(interp, lexer);
-    Token rparen = lexer_next_token(lexer);
-    token_free(&rparen);
-
-    val.is_string = false;
-    uint16_t addr = (uint16_t)v.number;
-    val.number = interp->ram[addr];
-    if (v.is_string)
-      safe_free(v.string);
-  }
-
-  token_free(&token);
-  return val;
-}
-
-Value evaluate_expression(Interpreter *interp, Lexer *lexer) {
-  /* Simplified: handles addition/concatenation and comparisons */
-  Value left = evaluate_factor(interp, lexer);
-
-  while (true) {
-    Token peek = lexer_peek_token(lexer);
-    if (peek.type == TOK_PLUS) {
-      lexer_next_token(lexer); // consume +
-      Value right = evaluate_factor(interp, lexer);
-      if (left.is_string && right.is_string) {
-        char *new_str =
-            safe_malloc(strlen(left.string) + strlen(right.string) + 1);
-        strcpy(new_str, left.string);
-        strcat(new_str, right.string);
-        safe_free(left.string);
-        safe_free(right.string);
-        left.string = new_str;
-      } else if (!left.is_string && !right.is_string) {
-        left.number += right.number;
-      }
-      token_free(&peek);
-    } else if (peek.type == TOK_EQUAL || peek.type == TOK_NOT_EQUAL ||
-               peek.type == TOK_LESS || peek.type == TOK_GREATER ||
-               peek.type == TOK_LESS_EQUAL || peek.type == TOK_GREATER_EQUAL) {
-      lexer_next_token(lexer); // consume operator
-      Value right = evaluate_factor(interp, lexer);
-      double res = 0;
-
-      if (left.is_string && right.is_string) {
-        int cmp = strcmp(left.string, right.string);
-        if (peek.type == TOK_EQUAL)
-          res = (cmp == 0);
-        else if (peek.type == TOK_NOT_EQUAL)
-          res = (cmp != 0);
-        else if (peek.type == TOK_LESS)
-          res = (cmp < 0);
-        else if (peek.type == TOK_GREATER)
-          res = (cmp > 0);
-        else if (peek.type == TOK_LESS_EQUAL)
-          res = (cmp <= 0);
-        else if (peek.type == TOK_GREATER_EQUAL)
-          res = (cmp >= 0);
-        safe_free(left.string);
-        safe_free(right.string);
-      } else if (!left.is_string && !right.is_string) {
-        if (peek.type == TOK_EQUAL)
-          res = (left.number == right.number);
-        else if (peek.type == TOK_NOT_EQUAL)
-          res = (left.number != right.number);
-        else if (peek.type == TOK_LESS)
-          res = (left.number < right.number);
-        else if (peek.type == TOK_GREATER)
-          res = (left.number > right.number);
-        else if (peek.type == TOK_LESS_EQUAL)
-          res = (left.number <= right.number);
-        else if (peek.type == TOK_GREATER_EQUAL)
-          res = (left.number >= right.number);
-      }
+  clear_stacks(interp);
+  clear_trap(interp);
+  interp->data_pointer = 0;
+  interp->current_line = interp->program;
+  vm_run(interp, interp->program->code_offset);
 
-      left.is_string = false;
-      left.number = res ? -1 : 0; // BASIC true is -1
-      token_free(&peek);
-    } else {
-      token_free(&peek);
-      break;
-    }
+  if (interp->error_occurred) {
+    report_program_error(interp);
   }
-  return left;
 }
 
-static void draw_line(Interpreter *interp, int x1, int y1, int x2, int y2) {
-  if (!interp->editor)
+void interpreter_execute_immediate(Interpreter *interp, const char *line) {
+  uint8_t *code = lexer_crunch(line, NULL);
+  if (!code) {
+    interpreter_error(interp, "OUT OF MEMORY");
     return;
-
-  // Scale from C64/C128 resolution (320x200) to terminal size
-  int tx1 = x1 * interp->editor->cols / 320;
-  int ty1 = y1 * interp->editor->rows / 200;
-  int tx2 = x2 * interp->editor->cols / 320;
-  int ty2 = y2 * interp->editor->rows / 200;
-
-  int dx = abs(tx2 - tx1);
-  int dy = abs(ty2 - ty1);
-  int sx = (tx1 < tx2) ? 1 : -1;
-  int sy = (ty1 < ty2) ? 1 : -1;
-  int err = dx - dy;
-
-  while (1) {
-    editor_plot(interp->editor, tx1, ty1, '*');
-    if (tx1 == tx2 && ty1 == ty2)
-      break;
-    int e2 = 2 * err;
-    if (e2 > -dy) {
-      err -= dy;
-      tx1 += sx;
-    }
-    if (e2 < dx) {
-      err += dx;
-      ty1 += sy;
-    }
   }
-}
-
-void interpreter_execute_line(Interpreter *interp, const char *line) {
-  Lexer lexer;
-  lexer_init(&lexer, line);
-
-  while (true) {
-    Token token = lexer_next_token(&lexer);
 
-    if (token.type == TOK_EOF || token.type == TOK_NEWLINE) {
-      token_free(&token);
-      break;
-    }
+  int entry = compile_immediate(interp, code);
+  safe_free(code);
+  if (entry < 0) {
+    interpreter_error(interp, "OUT OF MEMORY");
+    return;
+  }
 
-    if (token.type == TOK_PRINT || token.type == TOK_QUESTION) {
-      token_free(&token);
-      while (true) {
-        Token peek = lexer_peek_token(&lexer);
-        if (peek.type == TOK_EOF || peek.type == TOK_NEWLINE ||
-            peek.type == TOK_COLON) {
-          basic_print(interp, "\n");
-          token_free(&peek);
-          break;
-        }
-        token_free(&peek);
-
-        Value v = evaluate_expression(interp, &lexer);
-        if (v.is_string) {
-          /* Handle some CBM control characters */
-          if (v.string) {
-            for (char *p = v.string; *p; p++) {
-              unsigned char c = (unsigned char)*p;
-              if (interp->editor) {
-                if (c == 147) { // CLR/HOME
-                  editor_clear(interp->editor);
-                } else if (c == 19) { // HOME
-                  editor_move_cursor(interp->editor, 0, 0);
-                } else if (c == 17) { // CSR DOWN
-                  editor_move_cursor_relative(interp->editor, 1, 0);
-                } else if (c == 145) { // CSR UP
-                  editor_move_cursor_relative(interp->editor, -1, 0);
-                } else if (c == 157) { // CSR LEFT
-                  editor_move_cursor_relative(interp->editor, 0, -1);
-                } else if (c == 29) { // CSR RIGHT
-                  editor_move_cursor_relative(interp->editor, 0, 1);
-                } else {
-                  char buf[2] = {(char)c, 0};
-                  editor_print(interp->editor, buf);
-                }
-              } else {
-                if (c == 147) { // CLR/HOME
-                  printf("\x1b[2J\x1b[H");
-                } else if (c == 19) { // HOME
-                  printf("\x1b[H");
-                } else if (c == 17) { // CSR DOWN
-                  printf("\x1b[B");
-                } else if (c == 145) { // CSR UP
-                  printf("\x1b[A");
-                } else if (c == 157) { // CSR LEFT
-                  printf("\x1b[D");
-                } else if (c == 29) { // CSR RIGHT
-                  printf("\x1b[C");
-                } else {
-                  putchar(c);
-                }
-                fflush(stdout);
-              }
-            }
-          }
-          safe_free(v.string);
-        } else {
-          basic_print(interp, "%g", v.number);
-        }
-
-        peek = lexer_peek_token(&lexer);
-        if (peek.type == TOK_SEMICOLON) {
-          lexer_next_token(&lexer);
-          token_free(&peek);
-        } else if (peek.type == TOK_COMMA) {
-          lexer_next_token(&lexer);
-          token_free(&peek);
-          basic_print(interp, "\t");
-        } else {
-          basic_print(interp, "\n");
-          token_free(&peek);
-          break;
-        }
-      }
-    } else if (token.type == TOK_IF) {
-      token_free(&token);
-      Value cond = evaluate_expression(interp, &lexer);
-      Token then_tok = lexer_next_token(&lexer);
-
-      if (then_tok.type == TOK_THEN) {
-        if (cond.number != 0) {
-          /* THEN branch */
-          Token peek = lexer_peek_token(&lexer);
-          if (peek.type == TOK_NUMBER) {
-            /* IF...THEN [line] */
-            lexer_next_token(&lexer); // consume number
-            ProgramLine *target =
-                program_find_line(interp, (int)peek.number_value);
-            if (target) {
-              interp->current_line = target;
-              // Important: break the token loop so we don't execute rest of
-              // this line
-              token_free(&peek);
-              token_free(&then_tok);
-              if (cond.is_string)
-                safe_free(cond.string);
-              break;
-            }
-            token_free(&peek);
-          }
-          token_free(&peek);
-          /* IF...THEN [statement] -- just continue execution */
-        } else {
-          /* Skip to ELSE or end of line */
-          while (true) {
-            token = lexer_next_token(&lexer);
-            if (token.type == TOK_EOF || token.type == TOK_NEWLINE)
-              break;
-            if (token.type == TOK_ELSE)
-              break;
-            token_free(&token);
-          }
-        }
-      }
-      token_free(&then_tok);
-      if (cond.is_string)
-        safe_free(cond.string);
-    } else if (token.type == TOK_GOTO) {
-      token_free(&token);
-      Value v = evaluate_expression(interp, &lexer);
-      if (!v.is_string) {
-        ProgramLine *target = program_find_line(interp, (int)v.number);
-        if (target) {
-          interp->current_line = target;
-        } else {
-          interpreter_error(interp, "LINE NOT FOUND");
-        }
-      }
-      if (v.is_string)
-        safe_free(v.string);
-    } else if (token.type == TOK_GOSUB) {
-      token_free(&token);
-      Value v = evaluate_expression(interp, &lexer);
-      if (!v.is_string) {
-        ProgramLine *target = program_find_line(interp, (int)v.number);
-        if (target) {
-          if (interp->current_line) {
-            stack_push(interp, interp->current_line->line_number);
-          }
-          interp->current_line = target;
-        } else {
-          interpreter_error(interp, "LINE NOT FOUND");
-        }
-      }
-      if (v.is_string)
-        safe_free(v.string);
-    } else if (token.type == TOK_RETURN) {
-      token_free(&token);
-      int return_line = stack_pop(interp);
-      if (!interp->error_occurred) {
-        ProgramLine *target = program_find_line(interp, return_line);
-        if (target) {
-          interp->current_line = target->next;
-        } else {
-          // If the line was deleted, find the next one
-          // This is a bit complex, but standard BASIC behavior is usually
-          // to error or jump to next available.
-          // For now, let's just find the first line > return_line.
-          ProgramLine *curr = interp->program;
-          while (curr && curr->line_number <= return_line) {
-            curr = curr->next;
-          }
-          interp->current_line = curr;
-        }
-      }
-    } else if (token.type == TOK_LET || token.type == TOK_IDENTIFIER) {
-      char *name = NULL;
-      if (token.type == TOK_IDENTIFIER) {
-        name = str_duplicate(token.text);
-      } else {
-        token_free(&token);
-        token = lexer_next_token(&lexer);
-        if (token.type == TOK_IDENTIFIER) {
-          name = str_duplicate(token.text);
-        }
-      }
-      token_free(&token);
-
-      if (name) {
-        Token eq = lexer_next_token(&lexer);
-        if (eq.type == TOK_EQUAL) {
-          Value v = evaluate_expression(interp, &lexer);
-          if (v.is_string) {
-            var_set_string(interp, name, v.string);
-            safe_free(v.string);
-          } else {
-            var_set_number(interp, name, v.number);
-          }
-        } else {
-          interpreter_error(interp, "SYNTAX");
-        }
-        token_free(&eq);
-        safe_free(name);
-      }
-    } else if (token.type == TOK_POKE) {
-      token_free(&token);
-      Value addr = evaluate_expression(interp, &lexer);
-      Token comma = lexer_next_token(&lexer);
-      token_free(&comma);
-      Value val = evaluate_expression(interp, &lexer);
-
-      if (!addr.is_string && !val.is_string) {
-        uint16_t a = (uint16_t)addr.number;
-        uint8_t v = (uint8_t)val.number;
-        interp->ram[a] = v;
-
-        if (interp->editor) {
-          if (a == 53280 || a == 53281) {
-            editor_set_background_color(interp->editor, v);
-          } else if (a >= 1024 && a <= 2023) {
-            editor_poke_char(interp->editor, a, v);
-          }
-        }
-      }
-      if (addr.is_string)
-        safe_free(addr.string);
-      if (val.is_string)
-        safe_free(val.string);
-    } else if (token.type == TOK_PLOT) {
-      token_free(&token);
-      Value vx = evaluate_expression(interp, &lexer);
-      Token comma = lexer_next_token(&lexer);
-      token_free(&comma);
-      Value vy = evaluate_expression(interp, &lexer);
-      if (!vx.is_string && !vy.is_string) {
-        interp->graphics_x = vx.number;
-        interp->graphics_y = vy.number;
-      }
-      if (vx.is_string)
-        safe_free(vx.string);
-      if (vy.is_string)
-        safe_free(vy.string);
-    } else if (token.type == TOK_DRAW) {
-      token_free(&token);
-      Value vx = evaluate_expression(interp, &lexer);
-      Token comma = lexer_next_token(&lexer);
-      token_free(&comma);
-      Value vy = evaluate_expression(interp, &lexer);
-      if (!vx.is_string && !vy.is_string) {
-        draw_line(interp, (int)interp->graphics_x, (int)interp->graphics_y,
-                  (int)vx.number, (int)vy.number);
-        interp->graphics_x = vx.number;
-        interp->graphics_y = vy.number;
-      }
-      if (vx.is_string)
-        safe_free(vx.string);
-      if (vy.is_string)
-        safe_free(vy.string);
-    } else if (token.type == TOK_EXIT) {
-      interp->exit_requested = true;
-      interp->running = false;
-      token_free(&token);
-      break;
-    } else if (token.type == TOK_END || token.type == TOK_STOP) {
-      interp->running = false;
-      token_free(&token);
-      break;
-    } else if (token.type == TOK_COLON) {
-      token_free(&token);
-      continue;
-    } else if (token.type == TOK_CLR) {
-      if (interp->editor) {
-        editor_clear(interp->editor);
-      } else {
-        clear_screen();
-      }
-      token_free(&token);
-    } else if (token.type == TOK_MEMCHK) {
-      char mem_buf[256];
-      format_memory_size(mem_buf, get_free_memory(), total_memory_limit);
-      for (int i = 0; mem_buf[i]; i++) {
-        mem_buf[i] = toupper((unsigned char)mem_buf[i]);
-      }
-      basic_print(interp, "%s\n", mem_buf);
-      token_free(&token);
-    } else if (token.type == TOK_REM) {
-      token_free(&token);
-      break;
-    } else {
-      interpreter_error(interp, "SYNTAX");
-      token_free(&token);
-      break;
-    }
+  clear_stacks(interp);
+  interp->current_line = NULL;
+  vm_run(interp, entry);
 
-    if (interp->error_occurred)
-      break;
+  /* Errors in the immediate line itself are reported by the caller */
+  if (interp->error_occurred && interp->current_line) {
+    report_program_error(interp);
   }
-
-  lexer_free(&lexer);
 }
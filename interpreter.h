@@ -1,7 +1,9 @@
 #ifndef INTERPRETER_H
 #define INTERPRETER_H
 
+#include "bytecode.h"
 #include "lexer.h"
+#include "strheap.h"
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -16,56 +18,119 @@ typedef struct Interpreter Interpreter;
 /* Variable types */
 typedef enum {
   VAR_NUMBER,
+  VAR_INTEGER, /* Name ends in % */
   VAR_STRING,
-  VAR_ARRAY_NUMBER,
+  VAR_ARRAY_NUMBER, /* Arrays are named with a trailing ( */
+  VAR_ARRAY_INTEGER,
   VAR_ARRAY_STRING
 } VarType;
 
-/* Variable structure */
+typedef struct {
+  int32_t size;   /* Bound + 1 */
+  int32_t stride; /* Elements between consecutive subscripts */
+} ArrayDimension;
+
+/* DIM'd array: one block holding this header, then the doubles, int32_ts
+ * or string Values of the elements with the last subscript varying
+ * fastest. The element at subscripts s[] is elements[sum of s[i] *
+ * dimensions[i].stride]. An array never moves or changes shape, so
+ * compiled code and traces may hold on to it until the variables are
+ * cleared. */
+typedef struct Array {
+  void *elements;
+  int32_t count; /* Elements in all */
+  int dimension_count;
+  ArrayDimension dimensions[];
+} Array;
+
+/* Variable structure. The value is one word, as on the VM stack, but a
+ * number or % variable holds the bare double or int32_t so that traces
+ * and native code can work on it in place. */
 typedef struct Variable {
   char *name;
   VarType type;
   union {
     double number;
-    char *string;
-    struct {
-      void *data;
-      int *dimensions;
-      int dim_count;
-    } array;
+    int32_t integer;
+    Value string;
+    Array *array; /* NULL until DIM'd or first used */
   } value;
-  struct Variable *next;
 } Variable;
 
+/* Variables live in slots numbered in order of first use. The compiler
+ * resolves each name to its slot once; a case-insensitive hash of the
+ * names serves the remaining lookups by name. */
+typedef struct {
+  Variable **slots;
+  int count;
+  int capacity;
+  int *buckets;     /* Slot numbers, -1 when empty */
+  int bucket_count; /* Power of two */
+} VariableTable;
+
 /* Program line structure */
 typedef struct ProgramLine {
   int line_number;
-  char *text;
+  uint8_t *code; /* Crunched token stream, see lexer_crunch() */
+  int code_length;
+  int code_offset; /* Start of the line in the compiled program */
+  int data_index;  /* First DATA item at or after this line */
   struct ProgramLine *next;
 } ProgramLine;
 
-/* Stack frame for GOSUB/RETURN */
-typedef struct StackFrame {
-  int return_line;
-  struct StackFrame *next;
+/* Line number index: open-addressed hash table of program lines, kept in
+ * step with the listing so jumps resolve without walking it */
+typedef struct {
+  ProgramLine **slots;
+  int capacity; /* Power of two, or 0 before the first line */
+  int count;
+} LineIndex;
+
+/* Stack frame for GOSUB/RETURN: where to resume, down to the statement
+ * after the GOSUB */
+typedef struct {
+  ProgramLine *line;
+  int return_pc;
+  int for_depth; /* FOR loops opened inside the subroutine end at RETURN */
 } StackFrame;
 
-/* FOR loop context */
-typedef struct ForLoop {
-  char *var_name;
-  double end_value;
-  double step_value;
-  int loop_line;
-  struct ForLoop *next;
+/* Open FOR loop. NEXT updates the control variable through the pointer
+ * and jumps straight back to the first instruction of the body. */
+typedef struct {
+  Variable *var;
+  double limit; /* Limit and step of a number control variable */
+  double step;
+  int32_t integer_limit; /* Limit and step of a % control variable */
+  int32_t integer_step;
+  int body_pc;
+  ProgramLine *line; /* Line of the FOR, current again at each iteration */
 } ForLoop;
 
+#define MAX_FOR_DEPTH 256
+
 /* Interpreter state */
 typedef struct Interpreter {
   ProgramLine *program;
+  LineIndex line_index;
   ProgramLine *current_line;
-  Variable *variables;
-  StackFrame *call_stack;
-  ForLoop *for_stack;
+  VariableTable variables;
+  StringHeap strings; /* Characters of the string variables and values */
+  StackFrame *call_stack; /* Grows as needed and is kept between runs */
+  int call_depth;
+  int call_capacity;
+  ForLoop for_stack[MAX_FOR_DEPTH];
+  int for_depth;
+  int data_pointer; /* Next DATA item to READ */
+  /* TRAP: an error in a program line jumps to trap_line instead of
+   * ending the run. The rest is set when an error is trapped. */
+  int trap_line;    /* -1 when trapping is off */
+  bool trapped;     /* In the handler, where errors are not trapped */
+  int error_number; /* ER, -1 until an error is trapped */
+  int error_line;   /* EL */
+  ProgramLine *resume_line;
+  int resume_pc;      /* Statement that failed, -1 if unknown */
+  int resume_next_pc; /* Statement after it */
+  Bytecode bytecode;
   Editor *editor; // New: link to screen editor
   bool running;
   bool break_requested;
@@ -81,11 +146,13 @@ typedef struct Interpreter {
 void interpreter_init(Interpreter *interp);
 void interpreter_free(Interpreter *interp);
 void interpreter_run(Interpreter *interp);
-void interpreter_execute_line(Interpreter *interp, const char *line);
+void interpreter_execute_immediate(Interpreter *interp, const char *line);
 void interpreter_list(Interpreter *interp, int start, int end);
 void interpreter_new(Interpreter *interp);
 bool interpreter_load(Interpreter *interp, const char *filename);
 bool interpreter_save(Interpreter *interp, const char *filename);
+void interpreter_error(Interpreter *interp, const char *msg);
+void basic_print(Interpreter *interp, const char *format, ...);
 
 /* Program management */
 void program_add_line(Interpreter *interp, int line_num, const char *text);
@@ -94,20 +161,12 @@ ProgramLine *program_find_line(Interpreter *interp, int line_num);
 void program_clear(Interpreter *interp);
 
 /* Variable management */
-Variable *var_get(Interpreter *interp, const char *name);
-Variable *var_set_number(Interpreter *interp, const char *name, double value);
-Variable *var_set_string(Interpreter *interp, const char *name,
-                         const char *value);
+int var_slot(Interpreter *interp, const char *name, int length);
+void var_clear_arrays(Interpreter *interp);
 void var_clear_all(Interpreter *interp);
 
 /* Stack management */
-void stack_push(Interpreter *interp, int return_line);
+bool stack_push(Interpreter *interp, int return_pc);
 int stack_pop(Interpreter *interp);
 
-/* FOR loop management */
-void for_push(Interpreter *interp, const char *var_name, double end,
-              double step, int line);
-ForLoop *for_find(Interpreter *interp, const char *var_name);
-void for_pop(Interpreter *interp);
-
 #endif /* INTERPRETER_H */
@@ -0,0 +1,793 @@
+/* Needed for MAP_ANONYMOUS next to _POSIX_C_SOURCE */
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include "jit.h"
+#include "utils.h"
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R11 = 11, R12 };
+
+/* Condition codes of Jcc and SETcc */
+enum {
+  CC_O = 0x0,
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_S = 0x8,
+  CC_P = 0xA,
+  CC_NP = 0xB,
+  CC_L = 0xC,
+  CC_GE = 0xD,
+  CC_LE = 0xE,
+  CC_G = 0xF
+};
+
+#define ALWAYS -1 /* Condition of an unconditional jump */
+
+/* Opcodes, with 0x0F escapes in the upper bytes */
+#define MOVSD_LOAD 0x0F10 /* F2 */
+#define MOVSD_STORE 0x0F11
+#define ADDSD 0x0F58
+#define MULSD 0x0F59
+#define SUBSD 0x0F5C
+#define DIVSD 0x0F5E
+#define SQRTSD 0x0F51
+#define CVTSI2SD 0x0F2A
+#define CVTTSD2SI 0x0F2C
+#define UCOMISD 0x0F2E /* 66 */
+#define XORPD 0x0F57
+#define ROUNDSD 0x0F3A0B
+#define MOV_LOAD 0x8B
+#define MOV_STORE 0x89
+#define MOV_STORE_BYTE 0x88
+#define ADD 0x03
+#define SUB 0x2B
+#define AND 0x23
+#define OR 0x0B
+#define CMP 0x3B
+#define IMUL 0x0FAF
+#define MOVZX_BYTE 0x0FB6
+#define MOVZX_WORD 0x0FB7
+#define MOVSXD 0x63
+#define TEST 0x85
+#define GROUP_F7 0xF7 /* /2 NOT, /3 NEG */
+#define GROUP_81 0x81 /* /5 SUB, /7 CMP with imm32 */
+#define GROUP_83 0x83 /* /7 CMP with imm8 */
+#define GROUP_80 0x80 /* /7 CMP byte with imm8 */
+#define GROUP_BA 0x0FBA /* /6 BTR, /7 BTC with imm8 */
+#define GROUP_FF 0xFF   /* /1 DEC, /2 CALL */
+#define IMUL_IMMEDIATE 0x69
+#define ADD_WIDE 0x01
+#define SETCC 0x0F90
+
+#define ROUND_DOWN 9 /* ROUNDSD toward -infinity, without precision faults */
+
+/* rel32 field still to be filled in */
+typedef struct {
+  int at;
+  int op;    /* Op whose code, or whose exit, is jumped to */
+  bool exit; /* To the exit of op rather than its code */
+} Patch;
+
+typedef struct {
+  const Trace *trace;
+  uint8_t *code;
+  size_t length;
+  size_t capacity;
+  int *labels; /* Code offset of each op */
+  int *exits;  /* Code offset of each op's exit: -1 while nothing leaves
+                * there, 0 until it is generated */
+  Patch *patches;
+  int patch_count;
+  int patch_capacity;
+  bool rounding; /* SSE4.1 ROUNDSD is available */
+  bool failed;
+} Jit;
+
+static void byte(Jit *j, int value) {
+  if (j->length == j->capacity) {
+    size_t capacity = j->capacity ? j->capacity * 2 : 4096;
+    uint8_t *code = safe_realloc(j->code, j->capacity, capacity);
+    if (!code) {
+      j->failed = true;
+      return;
+    }
+    j->code = code;
+    j->capacity = capacity;
+  }
+  j->code[j->length++] = (uint8_t)value;
+}
+
+static void dword(Jit *j, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    byte(j, value >> (8 * i));
+  }
+}
+
+static void opcode(Jit *j, uint32_t op) {
+  if (op > 0xFFFF)
+    byte(j, op >> 16);
+  if (op > 0xFF)
+    byte(j, op >> 8);
+  byte(j, op);
+}
+
+/* Instruction on two registers, reg in the ModRM reg field */
+static void reg_op(Jit *j, int prefix, bool wide, uint32_t op, int reg,
+                   int rm) {
+  if (prefix)
+    byte(j, prefix);
+  int rex = 0x40 | wide << 3 | (reg >> 3) << 2 | rm >> 3;
+  if (rex != 0x40)
+    byte(j, rex);
+  opcode(j, op);
+  byte(j, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void load_address(Jit *j, int reg, uint64_t value) {
+  byte(j, 0x48 | reg >> 3);
+  byte(j, 0xB8 + (reg & 7));
+  for (int i = 0; i < 8; i++) {
+    byte(j, value >> (8 * i));
+  }
+}
+
+/* Instruction on a register and the value at address. Cells are reached
+ * through r12, which holds trace->cells; variables through r11. */
+static void mem_op(Jit *j, int prefix, bool wide, uint32_t op, int reg,
+                   const void *address) {
+  uintptr_t cells = (uintptr_t)j->trace->cells;
+  uintptr_t offset = (uintptr_t)address - cells;
+  bool in_cells = offset < j->trace->cell_count * sizeof(TraceCell);
+  if (!in_cells) {
+    load_address(j, R11, (uintptr_t)address);
+  }
+  if (prefix)
+    byte(j, prefix);
+  byte(j, 0x41 | wide << 3 | (reg >> 3) << 2);
+  opcode(j, op);
+  if (in_cells) {
+    byte(j, 0x80 | (reg & 7) << 3 | 4);
+    byte(j, 0x24);
+    dword(j, (uint32_t)offset);
+  } else {
+    byte(j, (reg & 7) << 3 | 3);
+  }
+}
+
+/* Instruction on a register and the field at base + offset. The base is
+ * rbx for the interpreter, or another register below r8 but not rsp. */
+static void field_op(Jit *j, int prefix, bool wide, uint32_t op, int reg,
+                     int base, size_t offset) {
+  if (prefix)
+    byte(j, prefix);
+  int rex = 0x40 | wide << 3 | (reg >> 3) << 2;
+  if (rex != 0x40)
+    byte(j, rex);
+  opcode(j, op);
+  byte(j, 0x80 | (reg & 7) << 3 | base);
+  dword(j, (uint32_t)offset);
+}
+
+/* Instruction on a register and the RAM byte addressed by rax */
+static void ram_op(Jit *j, uint32_t op, int reg) {
+  opcode(j, op);
+  byte(j, 0x80 | (reg & 7) << 3 | 4);
+  byte(j, RAX << 3 | RBX);
+  dword(j, offsetof(Interpreter, ram));
+}
+
+/* Instruction on a register below r8 and the element at rdx + rax * size,
+ * for elements of 4 or 8 bytes */
+static void element_op(Jit *j, int prefix, uint32_t op, int reg, int size) {
+  if (prefix)
+    byte(j, prefix);
+  opcode(j, op);
+  byte(j, reg << 3 | 4);
+  byte(j, (size == 8 ? 3 : 2) << 6 | RAX << 3 | RDX);
+}
+
+static void load_number(Jit *j, int xmm, const double *address) {
+  mem_op(j, 0xF2, false, MOVSD_LOAD, xmm, address);
+}
+
+static void store_number(Jit *j, int xmm, double *address) {
+  mem_op(j, 0xF2, false, MOVSD_STORE, xmm, address);
+}
+
+static void load_integer(Jit *j, int reg, const int32_t *address) {
+  mem_op(j, 0, false, MOV_LOAD, reg, address);
+}
+
+static void store_integer(Jit *j, int reg, int32_t *address) {
+  mem_op(j, 0, false, MOV_STORE, reg, address);
+}
+
+static void zero_number(Jit *j, int xmm) {
+  reg_op(j, 0x66, false, XORPD, xmm, xmm);
+}
+
+/* Jump with a rel32 to op's code, or to where op leaves the trace */
+static void jump(Jit *j, int cc, int op, bool exit) {
+  if (cc == ALWAYS) {
+    byte(j, 0xE9);
+  } else {
+    opcode(j, 0x0F80 | cc);
+  }
+  if (j->patch_count == j->patch_capacity) {
+    int capacity = j->patch_capacity ? j->patch_capacity * 2 : 64;
+    Patch *patches =
+        safe_realloc(j->patches, j->patch_capacity * sizeof(Patch),
+                     capacity * sizeof(Patch));
+    if (!patches) {
+      j->failed = true;
+      return;
+    }
+    j->patches = patches;
+    j->patch_capacity = capacity;
+  }
+  j->patches[j->patch_count++] = (Patch){(int)j->length, op, exit};
+  dword(j, 0);
+  if (exit) {
+    j->exits[op] = 0;
+  }
+}
+
+/* Short forward jump, landing where land() is called */
+static int skip(Jit *j, int cc) {
+  byte(j, cc == ALWAYS ? 0xEB : 0x70 | cc);
+  byte(j, 0);
+  return (int)j->length;
+}
+
+static void land(Jit *j, int from) {
+  if (!j->failed) {
+    j->code[from - 1] = (uint8_t)(j->length - from);
+  }
+}
+
+/* Replace a NaN in xmm by the one NaN, as number_canonical() */
+static void canonical_number(Jit *j, int xmm) {
+  static const double nan_value = NAN;
+  reg_op(j, 0x66, false, UCOMISD, xmm, xmm);
+  int over = skip(j, CC_NP);
+  load_number(j, xmm, &nan_value);
+  land(j, over);
+}
+
+/* Store the condition as -1 for true and 0 for false */
+static void store_condition(Jit *j, int cc, int32_t *address) {
+  reg_op(j, 0, false, SETCC | cc, 0, RAX);
+  reg_op(j, 0, false, MOVZX_BYTE, RAX, RAX);
+  reg_op(j, 0, false, GROUP_F7, 3, RAX);
+  store_integer(j, RAX, address);
+}
+
+/* Taken jump of op i, checking for BREAK on the way back */
+static void branch(Jit *j, int i) {
+  const TraceOp *op = &j->trace->ops[i];
+  if (op->back) {
+    field_op(j, 0, false, GROUP_80, 7, RBX,
+             offsetof(Interpreter, break_requested));
+    byte(j, 0);
+    jump(j, CC_NE, i, true);
+  }
+  jump(j, ALWAYS, op->target, false);
+}
+
+/* Leave the op to trace_step() */
+static void call_back(Jit *j, int i) {
+  reg_op(j, 0, true, MOV_STORE, RBX, RDI);
+  load_address(j, RSI, (uintptr_t)&j->trace->ops[i]);
+  load_address(j, RAX, (uintptr_t)trace_step);
+  reg_op(j, 0, false, GROUP_FF, 2, RAX);
+  reg_op(j, 0, false, TEST, RAX, RAX);
+  jump(j, CC_S, i, true);
+  if (j->trace->ops[i].op == TR_NEXT) {
+    jump(j, CC_NE, j->trace->ops[i].target, false);
+  }
+}
+
+static void number_op(Jit *j, const TraceOp *op, uint32_t code) {
+  load_number(j, 0, op->a.number);
+  mem_op(j, 0xF2, false, code, 0, op->b.number);
+  store_number(j, 0, op->dst.number);
+}
+
+/* Numeric comparison as COMPARE() makes it: unordered operands compare
+ * equal */
+static void compare_numbers(Jit *j, const TraceOp *op, bool swap, int cc) {
+  load_number(j, 0, swap ? op->b.number : op->a.number);
+  mem_op(j, 0x66, false, UCOMISD, 0, swap ? op->a.number : op->b.number);
+  store_condition(j, cc, op->dst.integer);
+}
+
+static void integer_op(Jit *j, int i, uint32_t code, bool guarded) {
+  const TraceOp *op = &j->trace->ops[i];
+  load_integer(j, RAX, op->a.integer);
+  mem_op(j, 0, false, code, RAX, op->b.integer);
+  if (guarded) {
+    jump(j, CC_O, i, true);
+  }
+  store_integer(j, RAX, op->dst.integer);
+}
+
+static void compare_integers(Jit *j, const TraceOp *op, int cc) {
+  load_integer(j, RAX, op->a.integer);
+  mem_op(j, 0, false, CMP, RAX, op->b.integer);
+  store_condition(j, cc, op->dst.integer);
+}
+
+/* rax = the index in a, rdx = the elements of op's array */
+static void element_address(Jit *j, const TraceOp *op) {
+  mem_op(j, 0, true, MOVSXD, RAX, op->a.integer);
+  load_address(j, RDX, (uintptr_t)op->array->elements);
+}
+
+/* NEXT of a known control variable, as next_iteration() in trace.c. Other
+ * NEXTs are left to trace_step(). */
+static void next_loop(Jit *j, int i) {
+  const TraceOp *op = &j->trace->ops[i];
+  Variable *var = op->var;
+  int done, negative;
+
+  /* rdx = the innermost loop, which must be op's */
+  field_op(j, 0, false, MOV_LOAD, RAX, RBX, offsetof(Interpreter, for_depth));
+  reg_op(j, 0, false, TEST, RAX, RAX);
+  jump(j, CC_E, i, true);
+  field_op(j, 0, false, GROUP_80, 7, RBX,
+           offsetof(Interpreter, break_requested));
+  byte(j, 0);
+  jump(j, CC_NE, i, true);
+  reg_op(j, 0, false, IMUL_IMMEDIATE, RAX, RAX);
+  dword(j, sizeof(ForLoop));
+  reg_op(j, 0, true, MOV_STORE, RBX, RDX);
+  reg_op(j, 0, true, ADD_WIDE, RAX, RDX);
+  size_t loop = offsetof(Interpreter, for_stack) - sizeof(ForLoop);
+  load_address(j, R11, (uintptr_t)var);
+  field_op(j, 0, true, CMP, R11, RDX, loop + offsetof(ForLoop, var));
+  jump(j, CC_NE, i, true);
+  field_op(j, 0, false, GROUP_81, 7, RDX, loop + offsetof(ForLoop, body_pc));
+  dword(j, (uint32_t)op->loop_pc);
+  jump(j, CC_NE, i, true);
+
+  if (var->type == VAR_INTEGER) {
+    /* The sum is taken in 64 bits and kept only if it fits */
+    mem_op(j, 0, true, MOVSXD, RAX, &var->value.integer);
+    field_op(j, 0, true, MOVSXD, RCX, RDX,
+             loop + offsetof(ForLoop, integer_step));
+    reg_op(j, 0, true, ADD_WIDE, RCX, RAX);
+    reg_op(j, 0, true, MOVSXD, RSI, RAX);
+    reg_op(j, 0, true, CMP, RSI, RAX);
+    int overflow = skip(j, CC_NE);
+    store_integer(j, RAX, &var->value.integer);
+    land(j, overflow);
+    field_op(j, 0, true, MOVSXD, RSI, RDX,
+             loop + offsetof(ForLoop, integer_limit));
+    reg_op(j, 0, false, TEST, RCX, RCX);
+    negative = skip(j, CC_S);
+    reg_op(j, 0, true, CMP, RAX, RSI);
+    jump(j, CC_LE, op->target, false);
+    done = skip(j, ALWAYS);
+    land(j, negative);
+    reg_op(j, 0, true, CMP, RAX, RSI);
+    jump(j, CC_GE, op->target, false);
+  } else {
+    load_number(j, 0, &var->value.number);
+    field_op(j, 0xF2, false, MOVSD_LOAD, 2, RDX,
+             loop + offsetof(ForLoop, step));
+    reg_op(j, 0xF2, false, ADDSD, 0, 2);
+    store_number(j, 0, &var->value.number);
+    field_op(j, 0xF2, false, MOVSD_LOAD, 1, RDX,
+             loop + offsetof(ForLoop, limit));
+    /* A step of NaN counts as negative, as value >= limit is then false */
+    zero_number(j, 3);
+    reg_op(j, 0x66, false, UCOMISD, 2, 3);
+    negative = skip(j, CC_B);
+    reg_op(j, 0x66, false, UCOMISD, 1, 0);
+    jump(j, CC_AE, op->target, false);
+    done = skip(j, ALWAYS);
+    land(j, negative);
+    reg_op(j, 0x66, false, UCOMISD, 0, 1);
+    jump(j, CC_AE, op->target, false);
+  }
+  land(j, done);
+  /* The loop is over */
+  field_op(j, 0, false, GROUP_FF, 1, RBX, offsetof(Interpreter, for_depth));
+}
+
+static void emit_op(Jit *j, int i) {
+  const TraceOp *op = &j->trace->ops[i];
+  int over, taken;
+  switch (op->op) {
+  case TR_MOVE_NUMBER:
+    mem_op(j, 0, true, MOV_LOAD, RAX, op->a.number);
+    mem_op(j, 0, true, MOV_STORE, RAX, op->dst.number);
+    break;
+  case TR_MOVE_INTEGER:
+    load_integer(j, RAX, op->a.integer);
+    store_integer(j, RAX, op->dst.integer);
+    break;
+  case TR_TO_NUMBER:
+    zero_number(j, 0);
+    mem_op(j, 0xF2, false, CVTSI2SD, 0, op->a.integer);
+    store_number(j, 0, op->dst.number);
+    break;
+  case TR_TO_INTEGER:
+    if (!j->rounding) {
+      call_back(j, i);
+      break;
+    }
+    /* The floor must survive a round trip through int32_t */
+    mem_op(j, 0x66, false, ROUNDSD, 0, op->a.number);
+    byte(j, ROUND_DOWN);
+    reg_op(j, 0xF2, true, CVTTSD2SI, RAX, 0);
+    reg_op(j, 0, true, MOVSXD, RCX, RAX);
+    reg_op(j, 0, true, CMP, RCX, RAX);
+    jump(j, CC_NE, i, true);
+    store_integer(j, RAX, op->dst.integer);
+    break;
+
+  case TR_ADD:
+    number_op(j, op, ADDSD);
+    break;
+  case TR_SUBTRACT:
+    number_op(j, op, SUBSD);
+    break;
+  case TR_MULTIPLY:
+    number_op(j, op, MULSD);
+    break;
+  case TR_DIVIDE:
+    /* Leave on a divisor of zero, which NaN is not */
+    load_number(j, 1, op->b.number);
+    zero_number(j, 2);
+    reg_op(j, 0x66, false, UCOMISD, 1, 2);
+    over = skip(j, CC_P);
+    jump(j, CC_E, i, true);
+    land(j, over);
+    load_number(j, 0, op->a.number);
+    reg_op(j, 0xF2, false, DIVSD, 0, 1);
+    store_number(j, 0, op->dst.number);
+    break;
+  case TR_NEGATE:
+  case TR_ABS:
+    /* Flip or clear the sign bit */
+    mem_op(j, 0, true, MOV_LOAD, RAX, op->a.number);
+    reg_op(j, 0, true, GROUP_BA, op->op == TR_NEGATE ? 7 : 6, RAX);
+    byte(j, 63);
+    mem_op(j, 0, true, MOV_STORE, RAX, op->dst.number);
+    break;
+  case TR_INT:
+    if (!j->rounding) {
+      call_back(j, i);
+      break;
+    }
+    mem_op(j, 0x66, false, ROUNDSD, 0, op->a.number);
+    byte(j, ROUND_DOWN);
+    store_number(j, 0, op->dst.number);
+    break;
+  case TR_SQR:
+    load_number(j, 0, op->a.number);
+    zero_number(j, 1);
+    reg_op(j, 0x66, false, UCOMISD, 1, 0);
+    jump(j, CC_A, i, true);
+    reg_op(j, 0xF2, false, SQRTSD, 0, 0);
+    store_number(j, 0, op->dst.number);
+    break;
+
+  case TR_EQUAL:
+    compare_numbers(j, op, false, CC_E);
+    break;
+  case TR_NOT_EQUAL:
+    compare_numbers(j, op, false, CC_NE);
+    break;
+  case TR_LESS:
+    compare_numbers(j, op, true, CC_A);
+    break;
+  case TR_GREATER:
+    compare_numbers(j, op, false, CC_A);
+    break;
+  case TR_LESS_EQUAL:
+    compare_numbers(j, op, false, CC_BE);
+    break;
+  case TR_GREATER_EQUAL:
+    compare_numbers(j, op, true, CC_BE);
+    break;
+
+  case TR_ADD_INT:
+    integer_op(j, i, ADD, true);
+    break;
+  case TR_SUBTRACT_INT:
+    integer_op(j, i, SUB, true);
+    break;
+  case TR_MULTIPLY_INT:
+    integer_op(j, i, IMUL, true);
+    break;
+  case TR_AND:
+    integer_op(j, i, AND, false);
+    break;
+  case TR_OR:
+    integer_op(j, i, OR, false);
+    break;
+  case TR_NEGATE_INT:
+  case TR_NOT:
+    load_integer(j, RAX, op->a.integer);
+    reg_op(j, 0, false, GROUP_F7, op->op == TR_NOT ? 2 : 3, RAX);
+    if (op->op == TR_NEGATE_INT) {
+      jump(j, CC_O, i, true);
+    }
+    store_integer(j, RAX, op->dst.integer);
+    break;
+  case TR_EQUAL_INT:
+    compare_integers(j, op, CC_E);
+    break;
+  case TR_NOT_EQUAL_INT:
+    compare_integers(j, op, CC_NE);
+    break;
+  case TR_LESS_INT:
+    compare_integers(j, op, CC_L);
+    break;
+  case TR_GREATER_INT:
+    compare_integers(j, op, CC_G);
+    break;
+  case TR_LESS_EQUAL_INT:
+    compare_integers(j, op, CC_LE);
+    break;
+  case TR_GREATER_EQUAL_INT:
+    compare_integers(j, op, CC_GE);
+    break;
+
+  case TR_PEEK:
+    load_integer(j, RAX, op->a.integer);
+    reg_op(j, 0, false, MOVZX_WORD, RAX, RAX);
+    ram_op(j, MOVZX_BYTE, RAX);
+    store_integer(j, RAX, op->dst.integer);
+    break;
+  case TR_POKE:
+    load_integer(j, RAX, op->a.integer);
+    reg_op(j, 0, false, MOVZX_WORD, RAX, RAX);
+    /* With an editor, the screen and its colours are left to the VM */
+    field_op(j, 0, true, GROUP_83, 7, RBX, offsetof(Interpreter, editor));
+    byte(j, 0);
+    over = skip(j, CC_E);
+    reg_op(j, 0, false, GROUP_81, 7, RAX);
+    dword(j, 53280);
+    jump(j, CC_E, i, true);
+    reg_op(j, 0, false, GROUP_81, 7, RAX);
+    dword(j, 53281);
+    jump(j, CC_E, i, true);
+    reg_op(j, 0, false, MOV_STORE, RAX, RCX);
+    reg_op(j, 0, false, GROUP_81, 5, RCX);
+    dword(j, 1024);
+    reg_op(j, 0, false, GROUP_81, 7, RCX);
+    dword(j, 999);
+    jump(j, CC_BE, i, true);
+    land(j, over);
+    load_integer(j, RCX, op->b.integer);
+    ram_op(j, MOV_STORE_BYTE, RCX);
+    break;
+
+  case TR_INDEX:
+  case TR_INDEX_UNCHECKED: {
+    const ArrayDimension *dimension = &op->array->dimensions[op->dimension];
+    load_integer(j, RAX, op->a.integer);
+    if (op->op == TR_INDEX) {
+      /* Unsigned, so that a negative subscript is out of bounds too */
+      reg_op(j, 0, false, GROUP_81, 7, RAX);
+      dword(j, (uint32_t)dimension->size);
+      jump(j, CC_AE, i, true);
+    }
+    if (dimension->stride != 1) {
+      reg_op(j, 0, false, IMUL_IMMEDIATE, RAX, RAX);
+      dword(j, (uint32_t)dimension->stride);
+    }
+    mem_op(j, 0, false, ADD, RAX, op->b.integer);
+    store_integer(j, RAX, op->dst.integer);
+    break;
+  }
+  case TR_LOAD_ELEMENT_NUMBER:
+    element_address(j, op);
+    element_op(j, 0xF2, MOVSD_LOAD, 0, sizeof(double));
+    canonical_number(j, 0);
+    store_number(j, 0, op->dst.number);
+    break;
+  case TR_LOAD_ELEMENT_INTEGER:
+    element_address(j, op);
+    element_op(j, 0, MOV_LOAD, RCX, sizeof(int32_t));
+    store_integer(j, RCX, op->dst.integer);
+    break;
+  case TR_STORE_ELEMENT_NUMBER:
+    load_number(j, 0, op->b.number);
+    canonical_number(j, 0);
+    element_address(j, op);
+    element_op(j, 0xF2, MOVSD_STORE, 0, sizeof(double));
+    break;
+  case TR_STORE_ELEMENT_INTEGER:
+    load_integer(j, RCX, op->b.integer);
+    element_address(j, op);
+    element_op(j, 0, MOV_STORE, RCX, sizeof(int32_t));
+    break;
+
+  case TR_JUMP:
+    branch(j, i);
+    break;
+  case TR_JUMP_IF_FALSE:
+    /* Taken on zero only, not on NaN */
+    load_number(j, 0, op->a.number);
+    zero_number(j, 1);
+    reg_op(j, 0x66, false, UCOMISD, 0, 1);
+    over = skip(j, CC_P);
+    taken = skip(j, CC_NE);
+    branch(j, i);
+    land(j, over);
+    land(j, taken);
+    break;
+  case TR_JUMP_IF_TRUE:
+    load_number(j, 0, op->a.number);
+    zero_number(j, 1);
+    reg_op(j, 0x66, false, UCOMISD, 0, 1);
+    taken = skip(j, CC_P);
+    over = skip(j, CC_E);
+    land(j, taken);
+    branch(j, i);
+    land(j, over);
+    break;
+  case TR_JUMP_IF_FALSE_INT:
+  case TR_JUMP_IF_TRUE_INT:
+    load_integer(j, RAX, op->a.integer);
+    reg_op(j, 0, false, TEST, RAX, RAX);
+    over = skip(j, op->op == TR_JUMP_IF_FALSE_INT ? CC_NE : CC_E);
+    branch(j, i);
+    land(j, over);
+    break;
+
+  case TR_EXIT:
+    jump(j, ALWAYS, i, true);
+    break;
+
+  case TR_MARK_FOR:
+    field_op(j, 0, false, MOV_LOAD, RAX, RBX, offsetof(Interpreter, for_depth));
+    store_integer(j, RAX, op->dst.integer);
+    break;
+  case TR_DROP_FOR:
+    load_integer(j, RAX, op->a.integer);
+    field_op(j, 0, false, CMP, RAX, RBX, offsetof(Interpreter, for_depth));
+    over = skip(j, CC_GE);
+    field_op(j, 0, false, MOV_STORE, RAX, RBX,
+             offsetof(Interpreter, for_depth));
+    land(j, over);
+    break;
+
+  case TR_NEXT:
+    if (op->var) {
+      next_loop(j, i);
+    } else {
+      call_back(j, i);
+    }
+    break;
+
+  default:
+    /* POWER, SIN, COS, TAN and FOR */
+    call_back(j, i);
+    break;
+  }
+}
+
+/* Return the index of the op that left, restoring the saved registers */
+static void epilogue(Jit *j, int i) {
+  byte(j, 0xB8);
+  dword(j, (uint32_t)i);
+  byte(j, 0x48); /* add rsp, 8 */
+  byte(j, 0x83);
+  byte(j, 0xC4);
+  byte(j, 8);
+  byte(j, 0x41); /* pop r12 */
+  byte(j, 0x5C);
+  byte(j, 0x5B); /* pop rbx */
+  byte(j, 0xC3);
+}
+
+static void generate(Jit *j) {
+  const Trace *trace = j->trace;
+  byte(j, 0x53); /* push rbx */
+  byte(j, 0x41); /* push r12 */
+  byte(j, 0x54);
+  byte(j, 0x48); /* sub rsp, 8, to keep calls aligned */
+  byte(j, 0x83);
+  byte(j, 0xEC);
+  byte(j, 8);
+  reg_op(j, 0, true, MOV_STORE, RDI, RBX);
+  load_address(j, R12, (uintptr_t)trace->cells);
+
+  for (int i = 0; i < trace->op_count; i++) {
+    j->labels[i] = (int)j->length;
+    emit_op(j, i);
+  }
+  for (int i = 0; i < trace->op_count; i++) {
+    if (j->exits[i] == 0) {
+      j->exits[i] = (int)j->length;
+      epilogue(j, i);
+    }
+  }
+  if (j->failed)
+    return;
+  for (int i = 0; i < j->patch_count; i++) {
+    const Patch *p = &j->patches[i];
+    int target = p->exit ? j->exits[p->op] : j->labels[p->op];
+    uint32_t rel = (uint32_t)(target - (p->at + 4));
+    memcpy(j->code + p->at, &rel, 4);
+  }
+}
+
+JitCode *jit_compile(const Trace *trace) {
+  Jit j;
+  memset(&j, 0, sizeof(j));
+  j.trace = trace;
+#ifdef __GNUC__
+  j.rounding = __builtin_cpu_supports("sse4.1");
+#endif
+  j.labels = safe_malloc(trace->op_count * sizeof(int));
+  j.exits = safe_malloc(trace->op_count * sizeof(int));
+  JitCode *code = NULL;
+  if (j.labels && j.exits) {
+    for (int i = 0; i < trace->op_count; i++) {
+      j.exits[i] = -1;
+    }
+    generate(&j);
+    if (!j.failed) {
+      code = safe_malloc(sizeof(JitCode));
+    }
+  }
+
+  if (code) {
+    /* Written first, then made executable */
+    code->size = j.length;
+    code->memory = mmap(NULL, j.length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code->memory == MAP_FAILED) {
+      safe_free(code);
+      code = NULL;
+    } else {
+      memcpy(code->memory, j.code, j.length);
+      if (mprotect(code->memory, j.length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code->memory, j.length);
+        safe_free(code);
+        code = NULL;
+      } else {
+        code->entry = (int (*)(Interpreter *))code->memory;
+      }
+    }
+  }
+  safe_free(j.code);
+  safe_free(j.labels);
+  safe_free(j.exits);
+  safe_free(j.patches);
+  return code;
+}
+
+void jit_free(JitCode *code) {
+  if (code) {
+    munmap(code->memory, code->size);
+    safe_free(code);
+  }
+}
+
+#else
+
+JitCode *jit_compile(const Trace *trace) {
+  (void)trace;
+  return NULL;
+}
+
+void jit_free(JitCode *code) { (void)code; }
+
+#endif
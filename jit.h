@@ -0,0 +1,23 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "trace.h"
+
+/* Native code for traces, built in with make JIT=1. Each op of a trace
+ * becomes a fixed x86-64 template working on the same cells and variables
+ * the trace interpreter uses; ops without a template call trace_step().
+ * Elsewhere than on x86-64 System V targets no code is generated and the
+ * traces are interpreted as before. */
+
+typedef struct JitCode {
+  int (*entry)(Interpreter *interp); /* Returns the index of the op that left */
+  void *memory;
+  size_t size;
+} JitCode;
+
+/* Generate code for a finished trace. Returns NULL if it cannot. */
+JitCode *jit_compile(const Trace *trace);
+
+void jit_free(JitCode *code);
+
+#endif /* JIT_H */
@@ -1,6 +1,7 @@
 #include "lexer.h"
 #include "utils.h"
 #include <ctype.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,49 +11,89 @@ typedef struct {
   TokenType type;
 } KeywordMapping;
 
-static KeywordMapping keywords[] = {
-    {"LIST", TOK_LIST},       {"RUN", TOK_RUN},       {"NEW", TOK_NEW},
-    {"LOAD", TOK_LOAD},       {"SAVE", TOK_SAVE},     {"EXIT", TOK_EXIT},
-    {"HELP", TOK_HELP},       {"MEMCHK", TOK_MEMCHK}, {"CLR", TOK_CLR},
-    {"PRINT", TOK_PRINT},     {"INPUT", TOK_INPUT},   {"LET", TOK_LET},
-    {"GOTO", TOK_GOTO},       {"GOSUB", TOK_GOSUB},   {"RETURN", TOK_RETURN},
-    {"IF", TOK_IF},           {"THEN", TOK_THEN},     {"ELSE", TOK_ELSE},
-    {"FOR", TOK_FOR},         {"TO", TOK_TO},         {"STEP", TOK_STEP},
-    {"NEXT", TOK_NEXT},       {"DO", TOK_DO},         {"LOOP", TOK_LOOP},
-    {"WHILE", TOK_WHILE},     {"WEND", TOK_WEND},     {"REPEAT", TOK_REPEAT},
-    {"UNTIL", TOK_UNTIL},     {"REM", TOK_REM},       {"END", TOK_END},
-    {"STOP", TOK_STOP},       {"DIM", TOK_DIM},       {"TRAP", TOK_TRAP},
-    {"RESUME", TOK_RESUME},   {"DATA", TOK_DATA},     {"READ", TOK_READ},
-    {"RESTORE", TOK_RESTORE}, {"POKE", TOK_POKE},     {"PLOT", TOK_PLOT},
-    {"DRAW", TOK_DRAW},       {"AND", TOK_AND},       {"OR", TOK_OR},
-    {"NOT", TOK_NOT},         {"ABS", TOK_ABS},       {"INT", TOK_INT},
-    {"RND", TOK_RND},         {"SIN", TOK_SIN},       {"COS", TOK_COS},
-    {"TAN", TOK_TAN},         {"SQR", TOK_SQR},       {"LEN", TOK_LEN},
-    {"LEFT$", TOK_LEFT},      {"RIGHT$", TOK_RIGHT},  {"MID$", TOK_MID},
-    {"STR$", TOK_STR},        {"VAL", TOK_VAL},       {"CHR$", TOK_CHR},
-    {"PEEK", TOK_PEEK},       {"ASC", TOK_ASC},       {NULL, TOK_ERROR}};
+/* Keywords are found with a perfect hash of the first two and last two
+ * characters (case folded) and the length. The multiplier was found by
+ * searching odd constants until every keyword got a slot of its own, so
+ * adding a keyword means searching again and regenerating this table. */
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 7
+#define KEYWORD_HASH_MULTIPLIER 0x0eafc28fu
+#define KEYWORD_TABLE_SIZE 256
+
+static const KeywordMapping keywords[KEYWORD_TABLE_SIZE] = {
+    [3] = {"RIGHT$", TOK_RIGHT},
+    [8] = {"THEN", TOK_THEN},
+    [10] = {"FOR", TOK_FOR},
+    [12] = {"GOTO", TOK_GOTO},
+    [15] = {"CHR$", TOK_CHR},
+    [16] = {"DO", TOK_DO},
+    [18] = {"UNTIL", TOK_UNTIL},
+    [20] = {"RETURN", TOK_RETURN},
+    [24] = {"LOOP", TOK_LOOP},
+    [28] = {"RESTORE", TOK_RESTORE},
+    [36] = {"TO", TOK_TO},
+    [37] = {"EL", TOK_EL},
+    [44] = {"RUN", TOK_RUN},
+    [46] = {"HELP", TOK_HELP},
+    [55] = {"STR$", TOK_STR},
+    [56] = {"MID$", TOK_MID},
+    [57] = {"FN", TOK_FN},
+    [64] = {"LIST", TOK_LIST},
+    [65] = {"RESUME", TOK_RESUME},
+    [68] = {"LET", TOK_LET},
+    [70] = {"ASC", TOK_ASC},
+    [74] = {"MEMCHK", TOK_MEMCHK},
+    [80] = {"COS", TOK_COS},
+    [91] = {"VAL", TOK_VAL},
+    [96] = {"PRINT", TOK_PRINT},
+    [99] = {"STOP", TOK_STOP},
+    [101] = {"WEND", TOK_WEND},
+    [106] = {"CLR", TOK_CLR},
+    [107] = {"NEXT", TOK_NEXT},
+    [110] = {"INPUT", TOK_INPUT},
+    [112] = {"WHILE", TOK_WHILE},
+    [114] = {"DATA", TOK_DATA},
+    [118] = {"RND", TOK_RND},
+    [120] = {"REM", TOK_REM},
+    [125] = {"GOSUB", TOK_GOSUB},
+    [131] = {"REPEAT", TOK_REPEAT},
+    [133] = {"SAVE", TOK_SAVE},
+    [134] = {"PEEK", TOK_PEEK},
+    [135] = {"ELSE", TOK_ELSE},
+    [140] = {"EXIT", TOK_EXIT},
+    [143] = {"OR", TOK_OR},
+    [144] = {"SQR", TOK_SQR},
+    [148] = {"ON", TOK_ON},
+    [150] = {"TAN", TOK_TAN},
+    [153] = {"POKE", TOK_POKE},
+    [154] = {"AND", TOK_AND},
+    [157] = {"ER", TOK_ER},
+    [158] = {"NOT", TOK_NOT},
+    [159] = {"ABS", TOK_ABS},
+    [162] = {"LEFT$", TOK_LEFT},
+    [175] = {"DIM", TOK_DIM},
+    [176] = {"READ", TOK_READ},
+    [192] = {"LOAD", TOK_LOAD},
+    [194] = {"SIN", TOK_SIN},
+    [202] = {"STEP", TOK_STEP},
+    [211] = {"NEW", TOK_NEW},
+    [212] = {"END", TOK_END},
+    [234] = {"LEN", TOK_LEN},
+    [241] = {"IF", TOK_IF},
+    [245] = {"PLOT", TOK_PLOT},
+    [247] = {"DRAW", TOK_DRAW},
+    [249] = {"TRAP", TOK_TRAP},
+    [252] = {"DEF", TOK_DEF},
+    [255] = {"INT", TOK_INT},
+};
 
 void lexer_init(Lexer *lexer, const char *input) {
   lexer->input = input;
+  lexer->code = NULL;
   lexer->position = 0;
   lexer->line = 1;
   lexer->column = 1;
-  lexer->current_token.type = TOK_ERROR;
-  lexer->current_token.text = NULL;
-}
-
-void lexer_free(Lexer *lexer) {
-  if (lexer->current_token.text) {
-    safe_free(lexer->current_token.text);
-    lexer->current_token.text = NULL;
-  }
-}
-
-void token_free(Token *token) {
-  if (token->text) {
-    safe_free(token->text);
-    token->text = NULL;
-  }
+  lexer->has_lookahead = false;
 }
 
 static char peek_char(Lexer *lexer) { return lexer->input[lexer->position]; }
@@ -77,11 +118,12 @@ static void skip_whitespace(Lexer *lexer) {
   }
 }
 
-static Token make_token(TokenType type, const char *text, double number_value,
-                        int line, int col) {
+static Token make_token(TokenType type, const char *text, int length,
+                        double number_value, int line, int col) {
   Token token;
   token.type = type;
-  token.text = text ? str_duplicate(text) : NULL;
+  token.text = text;
+  token.length = length;
   token.number_value = number_value;
   token.line_number = line;
   token.column = col;
@@ -115,16 +157,19 @@ static Token read_number(Lexer *lexer) {
     }
   }
 
+  /* Convert from a bounded local copy; strtod on the input itself would
+   * accept spellings such as 0x10 that the scan above stopped short of */
   int length = lexer->position - start;
-  char *num_str = safe_malloc(length + 1);
-  strncpy(num_str, &lexer->input[start], length);
-  num_str[length] = '\0';
-
-  double value = atof(num_str);
-  Token token = make_token(TOK_NUMBER, num_str, value, line, col);
-  safe_free(num_str);
+  char num_str[64];
+  int copied = length;
+  if (copied > (int)sizeof(num_str) - 1) {
+    copied = (int)sizeof(num_str) - 1;
+  }
+  memcpy(num_str, &lexer->input[start], copied);
+  num_str[copied] = '\0';
 
-  return token;
+  return make_token(TOK_NUMBER, &lexer->input[start], length, atof(num_str),
+                    line, col);
 }
 
 static Token read_string(Lexer *lexer) {
@@ -140,18 +185,35 @@ static Token read_string(Lexer *lexer) {
   }
 
   int length = lexer->position - start;
-  char *str = safe_malloc(length + 1);
-  strncpy(str, &lexer->input[start], length);
-  str[length] = '\0';
 
   if (peek_char(lexer) == '"') {
     next_char(lexer); /* Skip closing quote */
   }
 
-  Token token = make_token(TOK_STRING, str, 0, line, col);
-  safe_free(str);
+  return make_token(TOK_STRING, &lexer->input[start], length, 0, line, col);
+}
 
-  return token;
+static unsigned keyword_hash(const char *s, int length) {
+  uint32_t key = (uint32_t)((unsigned char)s[0] & 0xDF) |
+                 (uint32_t)((unsigned char)s[1] & 0xDF) << 8 |
+                 (uint32_t)((unsigned char)s[length - 2] & 0xDF) << 16 |
+                 (uint32_t)((unsigned char)s[length - 1] & 0xDF) << 24;
+  return ((key ^ (uint32_t)length) * KEYWORD_HASH_MULTIPLIER) >> 24;
+}
+
+/* One hash and at most one case-insensitive compare, in place */
+static TokenType keyword_lookup(const char *s, int length) {
+  if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
+    return TOK_IDENTIFIER;
+
+  const KeywordMapping *entry = &keywords[keyword_hash(s, length)];
+  /* The compare stops at a shorter keyword's end, so keyword[length] is
+   * only read once it is known to be in bounds */
+  if (entry->keyword &&
+      str_compare_nocase_n(s, entry->keyword, length) == 0 &&
+      entry->keyword[length] == '\0')
+    return entry->type;
+  return TOK_IDENTIFIER;
 }
 
 static Token read_identifier(Lexer *lexer) {
@@ -159,36 +221,88 @@ static Token read_identifier(Lexer *lexer) {
   int line = lexer->line;
   int col = lexer->column;
 
-  while (isalnum(peek_char(lexer)) || peek_char(lexer) == '_' ||
-         peek_char(lexer) == '$') {
+  while (isalnum(peek_char(lexer)) || peek_char(lexer) == '_') {
+    next_char(lexer);
+  }
+  /* Type suffix: $ for strings, % for integers */
+  if (peek_char(lexer) == '$' || peek_char(lexer) == '%') {
     next_char(lexer);
   }
 
+  const char *ident = &lexer->input[start];
   int length = lexer->position - start;
-  char *ident = safe_malloc(length + 1);
-  strncpy(ident, &lexer->input[start], length);
-  ident[length] = '\0';
-
-  /* Convert to uppercase for keyword matching */
-  char *upper = str_upper(ident);
-
-  /* Check if it's a keyword */
-  TokenType type = TOK_IDENTIFIER;
-  for (int i = 0; keywords[i].keyword != NULL; i++) {
-    if (strcmp(upper, keywords[i].keyword) == 0) {
-      type = keywords[i].type;
-      break;
-    }
+  TokenType type = keyword_lookup(ident, length);
+
+  /* FN runs into the function name, as in FNA(X) */
+  if (type == TOK_IDENTIFIER && length > 2 && (ident[0] & 0xDF) == 'F' &&
+      (ident[1] & 0xDF) == 'N') {
+    lexer->position = start + 2;
+    lexer->column = col + 2;
+    return make_token(TOK_FN, ident, 2, 0, line, col);
   }
 
-  Token token = make_token(type, ident, 0, line, col);
-  safe_free(ident);
-  safe_free(upper);
+  return make_token(type, ident, length, 0, line, col);
+}
+
+/* Decode the next record of a crunched stream; no lexing takes place and
+ * token text points into the stream */
+static Token read_crunched(Lexer *lexer) {
+  const uint8_t *p = lexer->code + lexer->position;
+  TokenType type = (TokenType)(*p & ~CRUNCH_SPACE);
+  Token token = make_token(type, NULL, 0, 0, 1, lexer->position);
+  uint16_t length;
+
+  if (type == TOK_EOF) {
+    return token;
+  }
+  p++;
+
+  switch (type) {
+  case TOK_NUMBER:
+    memcpy(&token.number_value, p, sizeof(double));
+    p += sizeof(double);
+    p += 1 + *p;
+    break;
+  case TOK_STRING:
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    token.text = (const char *)p;
+    token.length = length;
+    p += length;
+    break;
+  case TOK_IDENTIFIER:
+    length = *p++;
+    token.text = (const char *)p;
+    token.length = length;
+    p += length;
+    break;
+  case TOK_REM:
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length) + length;
+    break;
+  case TOK_DATA:
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    token.text = (const char *)p;
+    token.length = length;
+    p += length;
+    break;
+  case TOK_ERROR:
+    p++;
+    break;
+  default:
+    break;
+  }
 
+  lexer->position = (int)(p - lexer->code);
   return token;
 }
 
-Token lexer_next_token(Lexer *lexer) {
+static Token scan_token(Lexer *lexer) {
+  if (lexer->code) {
+    return read_crunched(lexer);
+  }
+
   skip_whitespace(lexer);
 
   char c = peek_char(lexer);
@@ -196,7 +310,7 @@ Token lexer_next_token(Lexer *lexer) {
   int col = lexer->column;
 
   if (c == '\0') {
-    return make_token(TOK_EOF, NULL, 0, line, col);
+    return make_token(TOK_EOF, NULL, 0, 0, line, col);
   }
 
   if (c == '\n' || c == '\r') {
@@ -204,7 +318,7 @@ Token lexer_next_token(Lexer *lexer) {
     if (c == '\r' && peek_char(lexer) == '\n') {
       next_char(lexer);
     }
-    return make_token(TOK_NEWLINE, NULL, 0, line, col);
+    return make_token(TOK_NEWLINE, NULL, 0, 0, line, col);
   }
 
   if (isdigit(c)) {
@@ -224,58 +338,325 @@ Token lexer_next_token(Lexer *lexer) {
 
   switch (c) {
   case '+':
-    return make_token(TOK_PLUS, "+", 0, line, col);
+    return make_token(TOK_PLUS, NULL, 0, 0, line, col);
   case '-':
-    return make_token(TOK_MINUS, "-", 0, line, col);
+    return make_token(TOK_MINUS, NULL, 0, 0, line, col);
   case '*':
-    return make_token(TOK_MULTIPLY, "*", 0, line, col);
+    return make_token(TOK_MULTIPLY, NULL, 0, 0, line, col);
   case '/':
-    return make_token(TOK_DIVIDE, "/", 0, line, col);
+    return make_token(TOK_DIVIDE, NULL, 0, 0, line, col);
   case '^':
-    return make_token(TOK_POWER, "^", 0, line, col);
+    return make_token(TOK_POWER, NULL, 0, 0, line, col);
   case '(':
-    return make_token(TOK_LPAREN, "(", 0, line, col);
+    return make_token(TOK_LPAREN, NULL, 0, 0, line, col);
   case ')':
-    return make_token(TOK_RPAREN, ")", 0, line, col);
+    return make_token(TOK_RPAREN, NULL, 0, 0, line, col);
   case ',':
-    return make_token(TOK_COMMA, ",", 0, line, col);
+    return make_token(TOK_COMMA, NULL, 0, 0, line, col);
   case ';':
-    return make_token(TOK_SEMICOLON, ";", 0, line, col);
+    return make_token(TOK_SEMICOLON, NULL, 0, 0, line, col);
   case ':':
-    return make_token(TOK_COLON, ":", 0, line, col);
+    return make_token(TOK_COLON, NULL, 0, 0, line, col);
   case '?':
-    return make_token(TOK_QUESTION, "?", 0, line, col);
+    return make_token(TOK_QUESTION, NULL, 0, 0, line, col);
   case '=':
-    return make_token(TOK_EQUAL, "=", 0, line, col);
+    return make_token(TOK_EQUAL, NULL, 0, 0, line, col);
   case '<':
     if (peek_char(lexer) == '=') {
       next_char(lexer);
-      return make_token(TOK_LESS_EQUAL, "<=", 0, line, col);
+      return make_token(TOK_LESS_EQUAL, NULL, 0, 0, line, col);
     } else if (peek_char(lexer) == '>') {
       next_char(lexer);
-      return make_token(TOK_NOT_EQUAL, "<>", 0, line, col);
+      return make_token(TOK_NOT_EQUAL, NULL, 0, 0, line, col);
     }
-    return make_token(TOK_LESS, "<", 0, line, col);
+    return make_token(TOK_LESS, NULL, 0, 0, line, col);
   case '>':
     if (peek_char(lexer) == '=') {
       next_char(lexer);
-      return make_token(TOK_GREATER_EQUAL, ">=", 0, line, col);
+      return make_token(TOK_GREATER_EQUAL, NULL, 0, 0, line, col);
     }
-    return make_token(TOK_GREATER, ">", 0, line, col);
+    return make_token(TOK_GREATER, NULL, 0, 0, line, col);
   }
 
-  return make_token(TOK_ERROR, NULL, 0, line, col);
+  return make_token(TOK_ERROR, NULL, 0, 0, line, col);
+}
+
+Token lexer_next_token(Lexer *lexer) {
+  if (lexer->has_lookahead) {
+    lexer->has_lookahead = false;
+    return lexer->lookahead;
+  }
+  return scan_token(lexer);
 }
 
+/* The peeked token is kept and handed out by the next lexer_next_token */
 Token lexer_peek_token(Lexer *lexer) {
-  int pos = lexer->position;
-  int line = lexer->line;
-  int col = lexer->column;
-  Token token = lexer_next_token(lexer);
-  lexer->position = pos;
-  lexer->line = line;
-  lexer->column = col;
-  return token;
+  if (!lexer->has_lookahead) {
+    lexer->lookahead = scan_token(lexer);
+    lexer->has_lookahead = true;
+  }
+  return lexer->lookahead;
+}
+
+void lexer_init_crunched(Lexer *lexer, const uint8_t *code) {
+  lexer_init(lexer, NULL);
+  lexer->code = code;
+}
+
+/* Growable byte buffer used while crunching and detokenizing */
+typedef struct {
+  uint8_t *data;
+  int length;
+  int capacity;
+  bool failed;
+} CrunchBuffer;
+
+static void buffer_init(CrunchBuffer *buf, int capacity) {
+  buf->data = safe_malloc(capacity);
+  buf->length = 0;
+  buf->capacity = capacity;
+  buf->failed = (buf->data == NULL);
+}
+
+static void buffer_put(CrunchBuffer *buf, const void *bytes, int count) {
+  if (buf->failed)
+    return;
+
+  if (buf->length + count > buf->capacity) {
+    int new_capacity = buf->capacity * 2;
+    while (new_capacity < buf->length + count) {
+      new_capacity *= 2;
+    }
+    uint8_t *new_data = safe_realloc(buf->data, buf->capacity, new_capacity);
+    if (!new_data) {
+      buf->failed = true;
+      return;
+    }
+    buf->data = new_data;
+    buf->capacity = new_capacity;
+  }
+
+  memcpy(buf->data + buf->length, bytes, count);
+  buf->length += count;
+}
+
+static void buffer_put_byte(CrunchBuffer *buf, uint8_t byte) {
+  buffer_put(buf, &byte, 1);
+}
+
+static void buffer_put_text(CrunchBuffer *buf, const char *text, int length,
+                            int limit) {
+  if (length > limit) {
+    length = limit;
+  }
+  if (limit > 255) {
+    uint16_t length16 = (uint16_t)length;
+    buffer_put(buf, &length16, sizeof(length16));
+  } else {
+    buffer_put_byte(buf, (uint8_t)length);
+  }
+  buffer_put(buf, text, length);
+}
+
+uint8_t *lexer_crunch(const char *text, int *length) {
+  Lexer lexer;
+  lexer_init(&lexer, text);
+
+  CrunchBuffer buf;
+  buffer_init(&buf, (int)strlen(text) + 16);
+
+  while (!buf.failed) {
+    int before = lexer.position;
+    skip_whitespace(&lexer);
+    uint8_t flag = lexer.position > before ? CRUNCH_SPACE : 0;
+    int start = lexer.position;
+
+    Token token = lexer_next_token(&lexer);
+    if (token.type == TOK_EOF || token.type == TOK_NEWLINE) {
+      break;
+    }
+
+    buffer_put_byte(&buf, (uint8_t)token.type | flag);
+
+    switch (token.type) {
+    case TOK_NUMBER: {
+      int spelling = lexer.position - start;
+      if (spelling > 255) {
+        spelling = 255;
+      }
+      buffer_put(&buf, &token.number_value, sizeof(double));
+      buffer_put_byte(&buf, (uint8_t)spelling);
+      buffer_put(&buf, &text[start], spelling);
+      break;
+    }
+    case TOK_STRING:
+      buffer_put_text(&buf, token.text, token.length, 65535);
+      break;
+    case TOK_IDENTIFIER:
+      buffer_put_text(&buf, token.text, token.length, 255);
+      break;
+    case TOK_REM: {
+      /* The comment is kept verbatim and ends the line */
+      const char *comment = &text[lexer.position];
+      int len = (int)strlen(comment);
+      while (len > 0 &&
+             (comment[len - 1] == '\r' || comment[len - 1] == '\n')) {
+        len--;
+      }
+      buffer_put_text(&buf, comment, len, 65535);
+      lexer.position += (int)strlen(comment);
+      break;
+    }
+    case TOK_DATA: {
+      /* Items are kept verbatim up to the end of the statement, since
+       * unquoted strings may contain anything but commas and colons */
+      const char *items = &text[lexer.position];
+      int len = 0;
+      bool quoted = false;
+      while (items[len] && items[len] != '\r' && items[len] != '\n' &&
+             (quoted || items[len] != ':')) {
+        if (items[len] == '"') {
+          quoted = !quoted;
+        }
+        len++;
+      }
+      buffer_put_text(&buf, items, len, 65535);
+      lexer.position += len;
+      break;
+    }
+    case TOK_ERROR:
+      buffer_put_byte(&buf, (uint8_t)text[start]);
+      break;
+    default:
+      break;
+    }
+  }
+
+  buffer_put_byte(&buf, TOK_EOF);
+
+  if (buf.failed) {
+    safe_free(buf.data);
+    return NULL;
+  }
+
+  if (length) {
+    *length = buf.length;
+  }
+  return buf.data;
+}
+
+static const char *token_spelling(TokenType type) {
+  for (int i = 0; i < KEYWORD_TABLE_SIZE; i++) {
+    if (keywords[i].keyword && keywords[i].type == type) {
+      return keywords[i].keyword;
+    }
+  }
+
+  switch (type) {
+  case TOK_PLUS:
+    return "+";
+  case TOK_MINUS:
+    return "-";
+  case TOK_MULTIPLY:
+    return "*";
+  case TOK_DIVIDE:
+    return "/";
+  case TOK_POWER:
+    return "^";
+  case TOK_EQUAL:
+    return "=";
+  case TOK_NOT_EQUAL:
+    return "<>";
+  case TOK_LESS:
+    return "<";
+  case TOK_GREATER:
+    return ">";
+  case TOK_LESS_EQUAL:
+    return "<=";
+  case TOK_GREATER_EQUAL:
+    return ">=";
+  case TOK_LPAREN:
+    return "(";
+  case TOK_RPAREN:
+    return ")";
+  case TOK_COMMA:
+    return ",";
+  case TOK_SEMICOLON:
+    return ";";
+  case TOK_COLON:
+    return ":";
+  case TOK_QUESTION:
+    return "?";
+  default:
+    return "";
+  }
+}
+
+char *lexer_detokenize(const uint8_t *code) {
+  CrunchBuffer buf;
+  buffer_init(&buf, 64);
+
+  const uint8_t *p = code;
+  while ((*p & ~CRUNCH_SPACE) != TOK_EOF && !buf.failed) {
+    TokenType type = (TokenType)(*p & ~CRUNCH_SPACE);
+    if (*p & CRUNCH_SPACE) {
+      buffer_put_byte(&buf, ' ');
+    }
+    p++;
+
+    uint16_t length;
+    switch (type) {
+    case TOK_NUMBER:
+      p += sizeof(double);
+      length = *p++;
+      buffer_put(&buf, p, length);
+      p += length;
+      break;
+    case TOK_STRING:
+      memcpy(&length, p, sizeof(length));
+      p += sizeof(length);
+      buffer_put_byte(&buf, '"');
+      buffer_put(&buf, p, length);
+      buffer_put_byte(&buf, '"');
+      p += length;
+      break;
+    case TOK_IDENTIFIER:
+      length = *p++;
+      buffer_put(&buf, p, length);
+      p += length;
+      break;
+    case TOK_REM:
+      memcpy(&length, p, sizeof(length));
+      p += sizeof(length);
+      buffer_put(&buf, "REM", 3);
+      buffer_put(&buf, p, length);
+      p += length;
+      break;
+    case TOK_DATA:
+      memcpy(&length, p, sizeof(length));
+      p += sizeof(length);
+      buffer_put(&buf, "DATA", 4);
+      buffer_put(&buf, p, length);
+      p += length;
+      break;
+    case TOK_ERROR:
+      buffer_put_byte(&buf, *p++);
+      break;
+    default: {
+      const char *spelling = token_spelling(type);
+      buffer_put(&buf, spelling, (int)strlen(spelling));
+      break;
+    }
+    }
+  }
+
+  buffer_put_byte(&buf, '\0');
+
+  if (buf.failed) {
+    safe_free(buf.data);
+    return NULL;
+  }
+  return (char *)buf.data;
 }
 
 const char *token_type_name(TokenType type) {
@@ -1,6 +1,9 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /* Token types */
 typedef enum {
   /* Literals */
@@ -25,6 +28,7 @@ typedef enum {
   TOK_LET,
   TOK_GOTO,
   TOK_GOSUB,
+  TOK_ON,
   TOK_RETURN,
   TOK_IF,
   TOK_THEN,
@@ -43,6 +47,7 @@ typedef enum {
   TOK_END,
   TOK_STOP,
   TOK_DIM,
+  TOK_DEF,
   TOK_TRAP,
   TOK_RESUME,
   TOK_DATA,
@@ -85,6 +90,9 @@ typedef enum {
   TOK_CHR,
   TOK_ASC,
   TOK_PEEK,
+  TOK_FN,
+  TOK_ER, /* Number and line of the last trapped error */
+  TOK_EL,
 
   /* Delimiters */
   TOK_LPAREN,
@@ -100,9 +108,12 @@ typedef enum {
   TOK_ERROR
 } TokenType;
 
+/* Token text is a view into the lexer's input or crunched stream, valid
+ * as long as that buffer is, and is not NUL-terminated */
 typedef struct {
   TokenType type;
-  char *text;
+  const char *text; /* Identifier name, string contents or DATA items */
+  int length;
   double number_value;
   int line_number;
   int column;
@@ -110,18 +121,34 @@ typedef struct {
 
 typedef struct {
   const char *input;
+  const uint8_t *code; /* Crunched stream, or NULL when lexing text */
   int position;
   int line;
   int column;
-  Token current_token;
+  Token lookahead; /* Token already scanned by lexer_peek_token */
+  bool has_lookahead;
 } Lexer;
 
 /* Lexer functions */
 void lexer_init(Lexer *lexer, const char *input);
-void lexer_free(Lexer *lexer);
 Token lexer_next_token(Lexer *lexer);
 Token lexer_peek_token(Lexer *lexer);
-void token_free(Token *token);
 const char *token_type_name(TokenType type);
 
+/* Crunching: program lines are tokenized once on entry into a compact
+ * stream. Each record starts with a TokenType byte (bit 7 set when blanks
+ * preceded it) followed by its payload:
+ *   TOK_NUMBER      double, length byte, source spelling
+ *   TOK_STRING      16-bit length, contents
+ *   TOK_IDENTIFIER  length byte, name
+ *   TOK_REM         16-bit length, raw comment text
+ *   TOK_DATA        16-bit length, raw items up to the end of the statement
+ *   TOK_ERROR       the offending character
+ * and the stream ends with a TOK_EOF byte. */
+#define CRUNCH_SPACE 0x80
+
+uint8_t *lexer_crunch(const char *text, int *length);
+char *lexer_detokenize(const uint8_t *code);
+void lexer_init_crunched(Lexer *lexer, const uint8_t *code);
+
 #endif /* LEXER_H */
@@ -0,0 +1,395 @@
+#include "strheap.h"
+#include "interpreter.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define STRING_HEAP_MIN 4096
+
+static void drop_builders(StringHeap *heap) {
+  memset(heap->builders, 0, sizeof(heap->builders));
+}
+
+/* Whether s has characters in the heap that a collection must keep */
+static bool in_heap(const StringHeap *heap, Value s) {
+  return value_tag(s) == VALUE_STRING_TAG && string_length(s) > 0 &&
+         string_offset(s) < heap->used;
+}
+
+static int by_offset(const void *a, const void *b) {
+  size_t x = string_offset(**(Value *const *)a);
+  size_t y = string_offset(**(Value *const *)b);
+  return (x > y) - (x < y);
+}
+
+/* Whether s has characters the collection of tag's block must keep.
+ * Empty literals are kept too, as their characters are terminated. */
+static bool is_root(const StringHeap *heap, Value s, unsigned tag) {
+  return tag == VALUE_LITERAL_TAG ? value_tag(s) == VALUE_LITERAL_TAG
+                                  : in_heap(heap, s);
+}
+
+/* Values of the given tag that a collection must keep, string array
+ * elements and values[0..depth) included, or NULL if there is no room to
+ * list them */
+static Value **find_roots(Interpreter *interp, Value *values, int depth,
+                          unsigned tag, int *count) {
+  StringHeap *heap = &interp->strings;
+  VariableTable *table = &interp->variables;
+  size_t size = table->count + depth + 1;
+  for (int i = 0; i < table->count; i++) {
+    Variable *var = table->slots[i];
+    if (var->type == VAR_ARRAY_STRING && var->value.array) {
+      size += var->value.array->count;
+    }
+  }
+  Value **roots = safe_malloc(size * sizeof(Value *));
+  if (!roots)
+    return NULL;
+  int n = 0;
+  for (int i = 0; i < table->count; i++) {
+    Variable *var = table->slots[i];
+    if (var->type == VAR_STRING && is_root(heap, var->value.string, tag)) {
+      roots[n++] = &var->value.string;
+    } else if (var->type == VAR_ARRAY_STRING && var->value.array) {
+      Value *elements = var->value.array->elements;
+      for (int32_t j = 0; j < var->value.array->count; j++) {
+        if (is_root(heap, elements[j], tag)) {
+          roots[n++] = &elements[j];
+        }
+      }
+    }
+  }
+  for (int i = 0; i < depth; i++) {
+    if (is_root(heap, values[i], tag)) {
+      roots[n++] = &values[i];
+    }
+  }
+  *count = n;
+  return roots;
+}
+
+/* Slide the referenced characters to the bottom of memory in address
+ * order and return how much of it is used. Values sharing characters, or
+ * holding a part of another string, stay together; with terminate each
+ * run of them is followed by a NUL. */
+static size_t slide(char *memory, Value **roots, int count, unsigned tag,
+                    bool terminate) {
+  qsort(roots, count, sizeof(Value *), by_offset);
+  size_t used = 0;
+  int i = 0;
+  while (i < count) {
+    size_t start = string_offset(*roots[i]);
+    size_t end = start + string_length(*roots[i]);
+    int j = i + 1;
+    while (j < count && string_offset(*roots[j]) <= end) {
+      size_t last = string_offset(*roots[j]) + string_length(*roots[j]);
+      if (last > end) {
+        end = last;
+      }
+      j++;
+    }
+    memmove(memory + used, memory + start, end - start);
+    for (; i < j; i++) {
+      *roots[i] = string_value(tag, used + (string_offset(*roots[i]) - start),
+                               string_length(*roots[i]));
+    }
+    used += end - start;
+    if (terminate) {
+      memory[used++] = '\0';
+    }
+  }
+  return used;
+}
+
+static void compact(StringHeap *heap, Value **roots, int count) {
+  heap->used = slide(heap->memory, roots, count, VALUE_STRING_TAG, false);
+  /* Builder room was not referenced, so it is gone */
+  drop_builders(heap);
+}
+
+/* Move the heap to a block of size bytes. Values hold offsets, so they
+ * stay as they are. */
+static bool move_heap(StringHeap *heap, size_t size) {
+  char *memory = safe_malloc(size);
+  if (!memory)
+    return false;
+  if (heap->used) {
+    memcpy(memory, heap->memory, heap->used);
+  }
+  safe_free(heap->memory);
+  heap->memory = memory;
+  heap->size = size;
+  drop_builders(heap);
+  return true;
+}
+
+/* Make sure length characters fit at the end of the heap, and if
+ * possible want more besides. Returns false when out of memory. */
+static bool make_room(Interpreter *interp, Value *stack, int depth,
+                      size_t length, size_t want) {
+  StringHeap *heap = &interp->strings;
+  if (heap->size - heap->used >= length + want)
+    return true;
+
+  int count = 0;
+  Value **roots = find_roots(interp, stack, depth, VALUE_STRING_TAG, &count);
+  if (!roots)
+    return false;
+  compact(heap, roots, count);
+  safe_free(roots);
+
+  /* Grow so that a quarter stays free, or collections would follow each
+   * other closely. Settle for less when memory is short. */
+  size_t size = heap->size ? heap->size : STRING_HEAP_MIN;
+  while (size - heap->used < length + want + size / 4) {
+    size *= 2;
+  }
+  if (size > UINT32_MAX) { /* Values hold 32-bit offsets */
+    size = UINT32_MAX;
+  }
+  if (size > heap->size && size >= get_free_memory()) {
+    size = heap->used + length + want;
+    if (size >= get_free_memory()) {
+      size = heap->used + length;
+      /* Fail here rather than in safe_malloc(), which would report the
+       * error before the caller can */
+      if (size > heap->size && size >= get_free_memory())
+        return false;
+    }
+  }
+  if (size > heap->size && !move_heap(heap, size))
+    return false;
+  return heap->size - heap->used >= length;
+}
+
+char *string_alloc(Interpreter *interp, Value *stack, int depth,
+                   size_t length, Value *out) {
+  static char empty[1];
+  StringHeap *heap = &interp->strings;
+  if (length == 0) {
+    *out = string_value(VALUE_STRING_TAG, 0, 0);
+    return empty;
+  }
+  if (!make_room(interp, stack, depth, length, 0))
+    return NULL;
+  *out = string_value(VALUE_STRING_TAG, heap->used, length);
+  heap->used += length;
+  return heap->memory + string_offset(*out);
+}
+
+/* Room for length more characters right after s, or NULL */
+static char *room_after(StringHeap *heap, Value s, size_t length) {
+  size_t end = string_offset(s) + string_length(s);
+  if (!in_heap(heap, s))
+    return NULL;
+  if (end == heap->used) {
+    if (heap->size - heap->used < length)
+      return NULL;
+    heap->used += length;
+    return heap->memory + end;
+  }
+  for (int i = 0; i < STRING_BUILDERS; i++) {
+    StringBuilder *builder = &heap->builders[i];
+    if (builder->end == end && builder->limit - end >= length) {
+      builder->end += length;
+      return heap->memory + end;
+    }
+  }
+  return NULL;
+}
+
+const char *string_concat(Interpreter *interp, Value *stack, int depth,
+                          int count) {
+  StringHeap *heap = &interp->strings;
+  Value *parts = &stack[depth - count];
+  size_t rest = 0;
+  for (int i = 1; i < count; i++) {
+    rest += string_length(parts[i]);
+  }
+  size_t length = string_length(parts[0]) + rest;
+  if (length > STRING_MAX_LENGTH)
+    return "STRING TOO LONG";
+
+  char *to = room_after(heap, parts[0], rest);
+  if (to) {
+    for (int i = 1; i < count; i++) {
+      String s = string_get(heap, parts[i]);
+      memcpy(to, s.chars, s.length);
+      to += s.length;
+    }
+    parts[0] = string_part(parts[0], 0, length);
+    return NULL;
+  }
+
+  /* Copy into a new string with as much room again behind it, unless
+   * memory is short; a collection takes back what goes unused */
+  size_t capacity = length < 16 ? 32 : length * 2;
+  if (!make_room(interp, stack, depth, length, capacity - length))
+    return "OUT OF MEMORY";
+  if (heap->size - heap->used < capacity) {
+    capacity = length;
+  }
+  size_t start = heap->used;
+  heap->used += capacity;
+  to = heap->memory + start;
+  for (int i = 0; i < count; i++) {
+    String s = string_get(heap, parts[i]);
+    if (s.length) {
+      memcpy(to, s.chars, s.length);
+      to += s.length;
+    }
+  }
+  if (capacity > length) {
+    StringBuilder *builder = &heap->builders[heap->next_builder];
+    heap->next_builder = (heap->next_builder + 1) % STRING_BUILDERS;
+    builder->end = start + length;
+    builder->limit = start + capacity;
+  }
+  parts[0] = string_value(VALUE_STRING_TAG, start, length);
+  return NULL;
+}
+
+static unsigned literal_hash(const char *chars, size_t length) {
+  unsigned hash = 2166136261u; /* FNV-1a */
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (unsigned char)chars[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static Value *literal_slot(StringHeap *heap, const char *chars,
+                           size_t length) {
+  unsigned mask = heap->literal_capacity - 1;
+  unsigned i = literal_hash(chars, length) & mask;
+  for (;;) {
+    Value *s = &heap->literals[i];
+    if (!s->bits || ((size_t)string_length(*s) == length &&
+                     memcmp(heap->literal_memory + string_offset(*s), chars,
+                            length) == 0))
+      return s;
+    i = (i + 1) & mask;
+  }
+}
+
+static bool grow_literals(StringHeap *heap) {
+  int capacity = heap->literal_capacity ? heap->literal_capacity * 2 : 64;
+  Value *literals = safe_malloc(capacity * sizeof(Value));
+  if (!literals)
+    return false;
+  memset(literals, 0, capacity * sizeof(Value));
+  Value *old = heap->literals;
+  int old_capacity = heap->literal_capacity;
+  heap->literals = literals;
+  heap->literal_capacity = capacity;
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].bits) {
+      String s = string_get(heap, old[i]);
+      *literal_slot(heap, s.chars, s.length) = old[i];
+    }
+  }
+  safe_free(old);
+  return true;
+}
+
+/* Drop the literals neither the constant pool nor a variable refers to
+ * any more, which lines typed in immediate mode and edits to the program
+ * leave behind. The compiler only runs with the VM stopped, so its stack
+ * holds none. */
+static bool sweep_literals(Interpreter *interp) {
+  StringHeap *heap = &interp->strings;
+  Bytecode *bc = &interp->bytecode;
+  int count = 0;
+  Value **roots = find_roots(interp, bc->strings, bc->string_count,
+                             VALUE_LITERAL_TAG, &count);
+  if (!roots)
+    return false;
+  heap->literal_used =
+      slide(heap->literal_memory, roots, count, VALUE_LITERAL_TAG, true);
+  safe_free(roots);
+
+  /* Only the constant pool is looked up again: a variable may hold a
+   * part of a literal */
+  memset(heap->literals, 0, heap->literal_capacity * sizeof(Value));
+  heap->literal_count = 0;
+  for (int i = 0; i < bc->string_count; i++) {
+    String s = string_get(heap, bc->strings[i]);
+    Value *slot = literal_slot(heap, s.chars, s.length);
+    if (!slot->bits) {
+      *slot = bc->strings[i];
+      heap->literal_count++;
+    }
+  }
+  return true;
+}
+
+/* Room for a literal of length characters and its terminator. A full
+ * block is swept before it grows, and grows so that a quarter stays free,
+ * or sweeps would follow each other closely. */
+static bool literal_room(Interpreter *interp, size_t length) {
+  StringHeap *heap = &interp->strings;
+  if (heap->literal_size - heap->literal_used >= length + 1)
+    return true;
+  if (heap->literal_used && !sweep_literals(interp))
+    return false;
+  size_t size = heap->literal_size ? heap->literal_size : 1024;
+  while (size - heap->literal_used < length + 1 + size / 4) {
+    size *= 2;
+  }
+  if (size == heap->literal_size)
+    return true;
+  char *memory = safe_realloc(heap->literal_memory, heap->literal_size, size);
+  if (!memory)
+    return false;
+  heap->literal_memory = memory;
+  heap->literal_size = size;
+  return true;
+}
+
+bool string_intern(Interpreter *interp, const char *chars, size_t length,
+                   Value *out) {
+  StringHeap *heap = &interp->strings;
+  if (length > STRING_MAX_LENGTH)
+    return false;
+  /* Keep the set at most half full */
+  if (heap->literal_count >= heap->literal_capacity / 2 &&
+      !grow_literals(heap))
+    return false;
+  Value *s = literal_slot(heap, chars, length);
+  if (!s->bits) {
+    if (!literal_room(interp, length))
+      return false;
+    /* A sweep refills the set */
+    s = literal_slot(heap, chars, length);
+    memcpy(heap->literal_memory + heap->literal_used, chars, length);
+    heap->literal_memory[heap->literal_used + length] = '\0';
+    *s = string_value(VALUE_LITERAL_TAG, heap->literal_used, length);
+    heap->literal_used += length + 1;
+    heap->literal_count++;
+  }
+  *out = *s;
+  return true;
+}
+
+static void free_literals(StringHeap *heap) {
+  safe_free(heap->literal_memory);
+  safe_free(heap->literals);
+  heap->literal_memory = NULL;
+  heap->literal_size = 0;
+  heap->literal_used = 0;
+  heap->literals = NULL;
+  heap->literal_count = 0;
+  heap->literal_capacity = 0;
+}
+
+void string_heap_clear(StringHeap *heap) {
+  heap->used = 0;
+  drop_builders(heap);
+  free_literals(heap);
+}
+
+void string_heap_free(StringHeap *heap) {
+  free_literals(heap);
+  safe_free(heap->memory);
+  memset(heap, 0, sizeof(*heap));
+}
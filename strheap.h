@@ -0,0 +1,86 @@
+#ifndef STRHEAP_H
+#define STRHEAP_H
+
+#include "value.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* String space. As on the C64, a string value is a descriptor of its
+ * characters, and copying the value copies the descriptor only. New
+ * strings are carved off the end of one block; when it is full, the
+ * strings still referenced from a variable, an array element or the VM
+ * stack are slid back together and the block grows if that did not free
+ * enough. A descriptor is a Value holding an offset into the block, so
+ * the block itself may move. */
+
+struct Interpreter;
+
+/* Characters of a string value, valid until the next string is made.
+ * They are not NUL-terminated and may be shared with other values, so
+ * they are never changed once a string is made. */
+typedef struct {
+  const char *chars;
+  int32_t length;
+} String;
+
+/* Room kept free after the result of a concatenation, so that appending
+ * to the result again does not copy it: end..limit is unused */
+typedef struct {
+  size_t end;
+  size_t limit;
+} StringBuilder;
+
+#define STRING_BUILDERS 4
+
+typedef struct {
+  char *memory;
+  size_t size;
+  size_t used;
+  StringBuilder builders[STRING_BUILDERS]; /* Dropped by a collection */
+  int next_builder;
+  /* Interned literals, NUL-terminated one after another in a block of
+   * their own that is only compacted when it is full */
+  char *literal_memory;
+  size_t literal_size;
+  size_t literal_used;
+  Value *literals; /* Open-addressed hash set of them, 0 when empty */
+  int literal_count;
+  int literal_capacity; /* Power of two */
+} StringHeap;
+
+static inline String string_get(const StringHeap *heap, Value s) {
+  const char *base = value_tag(s) == VALUE_LITERAL_TAG ? heap->literal_memory
+                                                       : heap->memory;
+  String view = {base ? base + string_offset(s) : "", string_length(s)};
+  return view;
+}
+
+/* Room for a new string of length characters, described by *out. stack
+ * [0..depth) are the VM values live besides the variables. Returns NULL
+ * when out of memory; any string may have moved when it returns. */
+char *string_alloc(struct Interpreter *interp, Value *stack, int depth,
+                   size_t length, Value *out);
+
+/* Join stack[depth - count..depth) into stack[depth - count]. A first
+ * string that ends where the rest can follow it is extended in place,
+ * so building a string up piece by piece takes linear time. Returns the
+ * error message, or NULL. */
+const char *string_concat(struct Interpreter *interp, Value *stack,
+                          int depth, int count);
+
+/* The one copy of a literal, made the first time it is compiled. Literal
+ * characters are NUL-terminated and last for as long as the constant
+ * pool or a variable refers to them, so values may refer to them without
+ * copying; any literal may move when it returns. Returns false when out
+ * of memory. */
+bool string_intern(struct Interpreter *interp, const char *chars,
+                   size_t length, Value *out);
+
+/* Drop every string at once, literals too, when no variable holds one
+ * any more and the compiled code is invalid */
+void string_heap_clear(StringHeap *heap);
+
+void string_heap_free(StringHeap *heap);
+
+#endif /* STRHEAP_H */
@@ -0,0 +1,21 @@
+10 REM EXIT ENDS THE FOR LOOPS OPENED INSIDE THE LOOP IT LEAVES
+20 FOR K=1 TO 3
+30 DO
+40 FOR I=1 TO 10
+50 IF I=2 THEN EXIT
+60 NEXT I
+70 LOOP
+80 PRINT "K";K
+90 N=N+1: IF N>3 THEN PRINT "NEXT TOOK THE WRONG LOOP": END
+100 NEXT
+110 REM WHILE AND REPEAT, IN A LOOP HOT ENOUGH TO BE TRACED
+120 FOR K=1 TO 3000
+130 N=0: WHILE N<5
+140 FOR I=1 TO 10: IF I=3 THEN N=N+1: IF N=4 THEN EXIT
+150 NEXT I
+160 WEND
+170 REPEAT: FOR J=1 TO 5: IF J=2 THEN EXIT
+180 NEXT J: UNTIL 1
+190 S=S+N+I+J
+200 NEXT
+210 PRINT S
@@ -0,0 +1,6 @@
+10 REM RUNNING OUT OF STRING SPACE RAISES ONE TRAPPABLE ERROR
+20 TRAP 100
+30 E$="Z"
+40 E$=E$+E$+"Z"
+50 GOTO 40
+100 PRINT "TRAPPED";ER;LEN(E$)
@@ -0,0 +1,8 @@
+10 REM VAL READS THE NUMBER A STRING STARTS WITH, AS BASIC WRITES IT
+20 PRINT VAL("12.5E1"), VAL("  -7"), VAL("3 APPLES")
+30 PRINT VAL("INF"), VAL("0x1F"), VAL("-NAN(0x9000000000007)")
+40 A$="AB": B$="CD"
+50 FOR I=1 TO 5000
+60 Y=VAL("-NAN(0xA00000000FFFF)")+LEN(B$+A$)
+70 NEXT I
+80 PRINT Y
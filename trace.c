@@ -0,0 +1,1544 @@
+#include "trace.h"
+#include "bytecode.h"
+#include "utils.h"
+#include <math.h>
+#ifdef CFBASIC_JIT
+#include "jit.h"
+#endif
+#include <string.h>
+
+/* Deepest VM stack a trace mirrors in registers */
+#define MAX_TRACE_DEPTH 256
+
+/* Where an operand comes from while the trace is being built */
+typedef enum {
+  FROM_NONE,
+  FROM_REGISTER,
+  FROM_VARIABLE,
+  FROM_CONSTANT
+} Source;
+
+typedef struct {
+  Source source;
+  bool integer;  /* Holds an int32_t rather than a double */
+  int index;     /* Register or constant */
+  Variable *var; /* FROM_VARIABLE */
+  int producer;  /* Op that computed a register */
+} Operand;
+
+/* Op whose operands are not yet addresses and whose jump target is still
+ * a pc */
+typedef struct {
+  TraceOp op;
+  Operand dst, a, b;
+  int target_pc; /* -1 when the op does not jump */
+} PendingOp;
+
+typedef struct {
+  Interpreter *interp;
+  const int32_t *code;
+  int head; /* Loop code is code[head..end) */
+  int end;
+  int site; /* Backward jump that closes the loop */
+  PendingOp *ops;
+  int op_count;
+  int op_capacity;
+  TraceCell *constants;
+  int constant_count;
+  int constant_capacity;
+  Operand stack[MAX_TRACE_DEPTH]; /* What the VM stack would hold */
+  int depth;
+  int registers;
+  int *index_of; /* First op for each pc where the VM stack is empty */
+  int restart;   /* Last such pc, where a failing guard resumes */
+  bool failed;   /* The loop cannot be traced at all */
+  /* Bounds checks on entry instead of in the loop, see TraceRange */
+  bool hoisting;
+  Variable *loop_var;
+  Variable **written; /* Variables stored in the loop, loop_var aside */
+  int written_count;
+  int written_capacity;
+  TraceRange *ranges;
+  int range_count;
+  int range_capacity;
+} Builder;
+
+static void free_trace(Trace *trace) {
+#ifdef CFBASIC_JIT
+  jit_free(trace->native);
+#endif
+  safe_free(trace->ops);
+  safe_free(trace->cells);
+  safe_free(trace->ranges);
+  safe_free(trace);
+}
+
+void trace_free(Bytecode *bc) {
+  for (int i = 0; i < bc->trace_count; i++) {
+    free_trace(bc->traces[i]);
+  }
+  safe_free(bc->traces);
+  safe_free(bc->back_edges);
+  bc->traces = NULL;
+  bc->trace_count = 0;
+  bc->trace_capacity = 0;
+  bc->back_edges = NULL;
+}
+
+void trace_reset(Bytecode *bc) {
+  trace_free(bc);
+  /* Without counters the program simply runs untraced */
+  size_t size = (bc->program_length ? bc->program_length : 1) * sizeof(int);
+  bc->back_edges = safe_malloc(size);
+  if (bc->back_edges) {
+    memset(bc->back_edges, 0, size);
+  }
+}
+
+/* Stack effect and length of the instruction at code[pc]. Returns false
+ * for an instruction the builder does not know. */
+static bool stack_effect(const int32_t *code, int pc, int *pops, int *pushes,
+                         int *length) {
+  *pops = 0;
+  *pushes = 0;
+  *length = 1;
+  switch (code[pc]) {
+  case OP_PUSH_NUMBER:
+  case OP_PUSH_INTEGER:
+  case OP_PUSH_STRING:
+  case OP_LOAD_NUMBER:
+  case OP_LOAD_INTEGER:
+  case OP_LOAD_STRING:
+  case OP_READ:
+    *pushes = 1;
+    *length = 2;
+    return true;
+  case OP_DIM:
+    *pops = code[pc + 2];
+    *length = 3;
+    return true;
+  case OP_ELEMENT:
+    *pops = code[pc + 2];
+    *pushes = 1;
+    *length = 3;
+    return true;
+  case OP_LOAD_ELEMENT_NUMBER:
+  case OP_LOAD_ELEMENT_INTEGER:
+  case OP_LOAD_ELEMENT_STRING:
+    *pops = 1;
+    *pushes = 1;
+    *length = 2;
+    return true;
+  case OP_STORE_ELEMENT_NUMBER:
+  case OP_STORE_ELEMENT_INTEGER:
+  case OP_STORE_ELEMENT_STRING:
+    *pops = 2;
+    *length = 2;
+    return true;
+  case OP_STORE_NUMBER:
+  case OP_STORE_INTEGER:
+  case OP_STORE_STRING:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    *pops = 1;
+    *length = 2;
+    return true;
+  case OP_LINE:
+  case OP_TO_NUMBER:
+  case OP_TO_INTEGER:
+  case OP_JUMP:
+  case OP_CALL:
+  case OP_RESTORE:
+  case OP_TRAP:
+  case OP_RESUME:
+  case OP_NEXT:
+  case OP_MARK_FOR:
+  case OP_DROP_FOR:
+  case OP_ERROR:
+    *length = 2;
+    return true;
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_POWER:
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+  case OP_ADD_INT:
+  case OP_SUBTRACT_INT:
+  case OP_MULTIPLY_INT:
+  case OP_AND:
+  case OP_OR:
+  case OP_LEFT:
+  case OP_RIGHT:
+    *pops = 2;
+    *pushes = 1;
+    return true;
+  case OP_COMPARE_INT:
+  case OP_STRING_COMPARE:
+    *pops = 2;
+    *pushes = 1;
+    *length = 2;
+    return true;
+  case OP_MID:
+    *pops = 3;
+    *pushes = 1;
+    return true;
+  case OP_CONCAT:
+    *pops = code[pc + 1];
+    *pushes = 1;
+    *length = 2;
+    return true;
+  case OP_NEGATE:
+  case OP_NEGATE_INT:
+  case OP_NOT:
+  case OP_ABS:
+  case OP_INT:
+  case OP_RND:
+  case OP_SIN:
+  case OP_COS:
+  case OP_TAN:
+  case OP_SQR:
+  case OP_PEEK:
+  case OP_LEN:
+  case OP_VAL:
+  case OP_ASC:
+  case OP_CHR:
+  case OP_STR:
+    *pops = 1;
+    *pushes = 1;
+    return true;
+  case OP_ER:
+  case OP_EL:
+    *pushes = 1;
+    return true;
+  case OP_PRINT_NUMBER:
+  case OP_PRINT_STRING:
+  case OP_GOTO:
+  case OP_GOSUB:
+    *pops = 1;
+    return true;
+  case OP_ON_GOTO:
+  case OP_ON_GOSUB:
+    *pops = 1;
+    *length = 2 + code[pc + 1];
+    return true;
+  case OP_FOR:
+    *pops = 2;
+    *length = 2;
+    return true;
+  case OP_POKE:
+  case OP_PLOT:
+  case OP_DRAW:
+    *pops = 2;
+    return true;
+  case OP_PRINT_TAB:
+  case OP_PRINT_NEWLINE:
+  case OP_RETURN:
+  case OP_CLR:
+  case OP_MEMCHK:
+  case OP_EXIT:
+  case OP_END:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool grow(Builder *b, void **data, int *capacity, int count,
+                 size_t element_size) {
+  if (count < *capacity)
+    return true;
+  int new_capacity = *capacity ? *capacity * 2 : 32;
+  void *new_data = safe_realloc(*data, *capacity * element_size,
+                                new_capacity * element_size);
+  if (!new_data) {
+    b->failed = true;
+    return false;
+  }
+  *data = new_data;
+  *capacity = new_capacity;
+  return true;
+}
+
+/* Append an op that resumes the VM at the current restart point if it
+ * leaves the trace. Returns its index, or -1 if out of memory. */
+static int emit(Builder *b, TraceOpcode op) {
+  if (!grow(b, (void **)&b->ops, &b->op_capacity, b->op_count,
+            sizeof(PendingOp)))
+    return -1;
+  PendingOp *p = &b->ops[b->op_count];
+  memset(p, 0, sizeof(*p));
+  p->op.op = op;
+  p->op.exit = b->restart;
+  p->target_pc = -1;
+  return b->op_count++;
+}
+
+static void emit_exit(Builder *b, int pc) {
+  int at = emit(b, TR_EXIT);
+  if (at >= 0) {
+    b->ops[at].op.exit = pc;
+  }
+}
+
+static bool push(Builder *b, Operand operand) {
+  if (b->depth == MAX_TRACE_DEPTH) {
+    b->failed = true;
+    return false;
+  }
+  b->stack[b->depth++] = operand;
+  return true;
+}
+
+static bool add_constant(Builder *b, Operand *operand, bool integer,
+                         double number, int32_t value) {
+  if (!grow(b, (void **)&b->constants, &b->constant_capacity,
+            b->constant_count, sizeof(TraceCell)))
+    return false;
+  TraceCell *cell = &b->constants[b->constant_count];
+  if (integer) {
+    cell->integer = value;
+  } else {
+    cell->number = number;
+  }
+  Operand constant = {FROM_CONSTANT, integer, b->constant_count++, NULL, -1};
+  *operand = constant;
+  return true;
+}
+
+static bool push_constant(Builder *b, bool integer, double number,
+                          int32_t value) {
+  Operand operand;
+  return add_constant(b, &operand, integer, number, value) &&
+         push(b, operand);
+}
+
+static Operand variable(Variable *var, bool integer) {
+  Operand operand = {FROM_VARIABLE, integer, 0, var, -1};
+  return operand;
+}
+
+/* Result of op 'at', kept in the register of stack slot 'position' */
+static Operand result(Builder *b, int position, bool integer, int at) {
+  if (position + 1 > b->registers) {
+    b->registers = position + 1;
+  }
+  Operand operand = {FROM_REGISTER, integer, position, NULL, at};
+  b->ops[at].dst = operand;
+  return operand;
+}
+
+static bool unary(Builder *b, TraceOpcode op, bool integer_operand,
+                  bool integer_result) {
+  if (b->depth < 1 || b->stack[b->depth - 1].integer != integer_operand)
+    return false;
+  int at = emit(b, op);
+  if (at < 0)
+    return false;
+  b->ops[at].a = b->stack[b->depth - 1];
+  b->stack[b->depth - 1] = result(b, b->depth - 1, integer_result, at);
+  return true;
+}
+
+static bool binary(Builder *b, TraceOpcode op, bool integer_operands,
+                   bool integer_result) {
+  if (b->depth < 2 || b->stack[b->depth - 2].integer != integer_operands ||
+      b->stack[b->depth - 1].integer != integer_operands)
+    return false;
+  int at = emit(b, op);
+  if (at < 0)
+    return false;
+  b->ops[at].a = b->stack[b->depth - 2];
+  b->ops[at].b = b->stack[b->depth - 1];
+  b->depth--;
+  b->stack[b->depth - 1] = result(b, b->depth - 1, integer_result, at);
+  return true;
+}
+
+/* Convert the stack slot at position in place, as OP_TO_NUMBER and
+ * OP_TO_INTEGER do */
+static bool convert(Builder *b, int position, bool integer) {
+  if (position < 0 || position >= b->depth)
+    return false;
+  if (b->stack[position].integer == integer)
+    return true;
+  int at = emit(b, integer ? TR_TO_INTEGER : TR_TO_NUMBER);
+  if (at < 0)
+    return false;
+  b->ops[at].a = b->stack[position];
+  b->stack[position] = result(b, position, integer, at);
+  return true;
+}
+
+static bool store(Builder *b, Variable *var, bool integer) {
+  if (b->depth < 1)
+    return false;
+  Operand value = b->stack[b->depth - 1];
+  Operand dst = variable(var, integer);
+
+  if (value.integer == integer && value.source == FROM_REGISTER &&
+      value.producer == b->op_count - 1) {
+    /* The value was just computed: compute it into the variable */
+    b->ops[value.producer].dst = dst;
+  } else {
+    int at = emit(b, value.integer == integer
+                         ? (integer ? TR_MOVE_INTEGER : TR_MOVE_NUMBER)
+                         : (integer ? TR_TO_INTEGER : TR_TO_NUMBER));
+    if (at < 0)
+      return false;
+    b->ops[at].a = value;
+    b->ops[at].dst = dst;
+  }
+  b->depth--;
+  return true;
+}
+
+/* Jumps only happen with the VM stack empty, which is what lets a trace
+ * resume the VM at the last empty point */
+static bool jump(Builder *b, TraceOpcode op, int target_pc) {
+  if (b->depth != 0) {
+    b->failed = true;
+    return false;
+  }
+  int at = emit(b, op);
+  if (at < 0)
+    return false;
+  b->ops[at].target_pc = target_pc;
+  return true;
+}
+
+static bool conditional_jump(Builder *b, bool when, int target_pc) {
+  if (b->depth < 1)
+    return false;
+  Operand condition = b->stack[--b->depth];
+  TraceOpcode op = condition.integer
+                       ? (when ? TR_JUMP_IF_TRUE_INT : TR_JUMP_IF_FALSE_INT)
+                       : (when ? TR_JUMP_IF_TRUE : TR_JUMP_IF_FALSE);
+  if (!jump(b, op, target_pc))
+    return false;
+  b->ops[b->op_count - 1].a = condition;
+  return true;
+}
+
+/* Program line holding the given pc */
+static ProgramLine *line_at(const Bytecode *bc, int pc) {
+  int low = 0;
+  int high = bc->line_count - 1;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (bc->lines[mid]->code_offset <= pc) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return bc->lines[low];
+}
+
+static bool for_loop(Builder *b, Variable *var, int body_pc) {
+  bool integer = var->type == VAR_INTEGER;
+  if (b->depth != 2 || b->stack[0].integer != integer ||
+      b->stack[1].integer != integer)
+    return false;
+  int at = emit(b, TR_FOR);
+  if (at < 0)
+    return false;
+  b->ops[at].a = b->stack[0];
+  b->ops[at].b = b->stack[1];
+  b->ops[at].op.var = var;
+  b->ops[at].op.loop_pc = body_pc;
+  b->ops[at].op.line = line_at(&b->interp->bytecode, body_pc);
+  b->depth = 0;
+  return true;
+}
+
+/* NEXT closing the traced loop jumps to its head. Any other NEXT is
+ * expected to close the nearest FOR before it on the same variable. */
+static bool next_loop(Builder *b, Variable *var, int pc) {
+  int body_pc = -1;
+  if (pc == b->site) {
+    body_pc = b->head;
+  } else {
+    for (int i = b->op_count - 1; i >= 0; i--) {
+      const TraceOp *op = &b->ops[i].op;
+      if (op->op == TR_FOR && (!var || op->var == var)) {
+        body_pc = op->loop_pc;
+        break;
+      }
+    }
+  }
+  if (body_pc < 0 || !jump(b, TR_NEXT, body_pc))
+    return false;
+  b->ops[b->op_count - 1].op.var = var;
+  b->ops[b->op_count - 1].op.loop_pc = body_pc;
+  return true;
+}
+
+/* Variables stored anywhere in the loop code, except the control variable
+ * of the traced loop by the NEXT that closes it. Hoisting stays off when
+ * that variable is not known. */
+static void find_writes(Builder *b) {
+  Variable **vars = b->interp->variables.slots;
+  b->hoisting = true;
+  for (int pc = b->head; pc < b->end;) {
+    int pops, pushes, length;
+    if (!stack_effect(b->code, pc, &pops, &pushes, &length))
+      break;
+    int op = b->code[pc];
+    int arg = b->code[pc + 1];
+    if (op == OP_NEXT && pc == b->site) {
+      b->hoisting = b->loop_var != NULL;
+    } else if ((op == OP_STORE_NUMBER || op == OP_STORE_INTEGER ||
+                op == OP_FOR || op == OP_NEXT) &&
+               arg >= 0) {
+      /* A NEXT of the innermost loop closes a FOR in the loop, which is
+       * listed already */
+      if (!grow(b, (void **)&b->written, &b->written_capacity,
+                b->written_count, sizeof(Variable *)))
+        return;
+      b->written[b->written_count++] = vars[arg];
+    }
+    pc += length;
+  }
+}
+
+/* Whether operand is floor(var + offset) for the value var has when it
+ * is computed, var being a variable the loop does not store */
+static bool invariant_form(Builder *b, const Operand *operand,
+                           Variable **var, double *offset) {
+  Operand x = *operand;
+  *offset = 0;
+  if (x.source == FROM_REGISTER && b->ops[x.producer].op.op == TR_TO_INTEGER) {
+    x = b->ops[x.producer].a;
+  }
+  if (x.source == FROM_REGISTER) {
+    const PendingOp *p = &b->ops[x.producer];
+    bool add = p->op.op == TR_ADD || p->op.op == TR_ADD_INT;
+    bool subtract = p->op.op == TR_SUBTRACT || p->op.op == TR_SUBTRACT_INT;
+    Operand constant = p->b;
+    x = p->a;
+    if (add && x.source == FROM_CONSTANT) {
+      constant = p->a;
+      x = p->b;
+    }
+    if ((!add && !subtract) || constant.source != FROM_CONSTANT)
+      return false;
+    const TraceCell *cell = &b->constants[constant.index];
+    *offset = constant.integer ? cell->integer : cell->number;
+    if (subtract) {
+      *offset = -*offset;
+    }
+  }
+  if (x.source != FROM_VARIABLE)
+    return false;
+  for (int i = 0; i < b->written_count; i++) {
+    if (b->written[i] == x.var)
+      return false;
+  }
+  *var = x.var;
+  return true;
+}
+
+/* Whether a subscript needs no check in the trace: a constant in bounds,
+ * or a value whose range is checked on entry instead */
+static bool hoist(Builder *b, const Operand *subscript, int32_t size) {
+  Variable *var;
+  double offset;
+  if (subscript->source == FROM_CONSTANT) {
+    int32_t value = b->constants[subscript->index].integer;
+    return value >= 0 && value < size;
+  }
+  if (!b->hoisting || !invariant_form(b, subscript, &var, &offset))
+    return false;
+  for (int i = 0; i < b->range_count; i++) {
+    const TraceRange *range = &b->ranges[i];
+    if (range->var == var && range->offset == offset && range->size == size)
+      return true;
+  }
+  if (!grow(b, (void **)&b->ranges, &b->range_capacity, b->range_count,
+            sizeof(TraceRange)))
+    return false;
+  TraceRange range = {var, offset, size};
+  b->ranges[b->range_count++] = range;
+  return true;
+}
+
+/* As OP_ELEMENT, on an array that already exists and so stays put: the
+ * index is built up one subscript at a time in the register of the first */
+static bool element(Builder *b, Variable *var, int count) {
+  Array *array = var->value.array;
+  /* String elements are left to the VM */
+  if (!array || var->type == VAR_ARRAY_STRING ||
+      array->dimension_count != count || b->depth < count)
+    return false;
+  int base = b->depth - count;
+  for (int i = base; i < b->depth; i++) {
+    if (!b->stack[i].integer)
+      return false;
+  }
+
+  Operand index;
+  if (!add_constant(b, &index, true, 0, 0))
+    return false;
+  for (int i = 0; i < count; i++) {
+    Operand subscript = b->stack[base + i];
+    const ArrayDimension *dimension = &array->dimensions[i];
+    bool checked = !hoist(b, &subscript, dimension->size);
+    if (!checked && count == 1) {
+      /* The subscript is the index */
+      index = subscript;
+      break;
+    }
+    int at = emit(b, checked ? TR_INDEX : TR_INDEX_UNCHECKED);
+    if (at < 0)
+      return false;
+    b->ops[at].a = subscript;
+    b->ops[at].b = index;
+    b->ops[at].op.array = array;
+    b->ops[at].op.dimension = i;
+    index = result(b, base, true, at);
+  }
+  b->depth = base;
+  return push(b, index);
+}
+
+static bool load_element(Builder *b, Array *array, bool integer) {
+  if (!array || !unary(b, integer ? TR_LOAD_ELEMENT_INTEGER
+                                  : TR_LOAD_ELEMENT_NUMBER,
+                       true, integer))
+    return false;
+  b->ops[b->op_count - 1].op.array = array;
+  return true;
+}
+
+/* An integer element converts what is stored, as OP_STORE_INTEGER does */
+static bool store_element(Builder *b, Array *array, bool integer) {
+  if (!array || b->depth < 2 || !b->stack[b->depth - 2].integer ||
+      !convert(b, b->depth - 1, integer))
+    return false;
+  int at = emit(b, integer ? TR_STORE_ELEMENT_INTEGER
+                           : TR_STORE_ELEMENT_NUMBER);
+  if (at < 0)
+    return false;
+  b->ops[at].a = b->stack[b->depth - 2];
+  b->ops[at].b = b->stack[b->depth - 1];
+  b->ops[at].op.array = array;
+  b->depth -= 2;
+  return true;
+}
+
+/* Translate the instruction at code[pc]. Returns false if a trace cannot
+ * run it, leaving the stack as it was. */
+static bool translate(Builder *b, int pc) {
+  Interpreter *interp = b->interp;
+  const Bytecode *bc = &interp->bytecode;
+  Variable **vars = interp->variables.slots;
+  int op = b->code[pc];
+  int arg = b->code[pc + 1];
+
+  switch (op) {
+  case OP_LINE:
+    /* The line is looked up again when the trace exits */
+    return true;
+  case OP_PUSH_NUMBER:
+    return push_constant(b, false, bc->numbers[arg], 0);
+  case OP_PUSH_INTEGER:
+    return push_constant(b, true, 0, arg);
+  case OP_LOAD_NUMBER:
+  case OP_LOAD_INTEGER:
+    return push(b, variable(vars[arg], op == OP_LOAD_INTEGER));
+  case OP_STORE_NUMBER:
+  case OP_STORE_INTEGER:
+    return store(b, vars[arg], op == OP_STORE_INTEGER);
+  case OP_TO_NUMBER:
+  case OP_TO_INTEGER:
+    return convert(b, b->depth - 1 - arg, op == OP_TO_INTEGER);
+
+  case OP_ELEMENT:
+    return element(b, vars[arg], b->code[pc + 2]);
+  case OP_LOAD_ELEMENT_NUMBER:
+  case OP_LOAD_ELEMENT_INTEGER:
+    return load_element(b, vars[arg]->value.array,
+                        op == OP_LOAD_ELEMENT_INTEGER);
+  case OP_STORE_ELEMENT_NUMBER:
+  case OP_STORE_ELEMENT_INTEGER:
+    return store_element(b, vars[arg]->value.array,
+                         op == OP_STORE_ELEMENT_INTEGER);
+
+  case OP_ADD:
+    return binary(b, TR_ADD, false, false);
+  case OP_SUBTRACT:
+    return binary(b, TR_SUBTRACT, false, false);
+  case OP_MULTIPLY:
+    return binary(b, TR_MULTIPLY, false, false);
+  case OP_DIVIDE:
+    return binary(b, TR_DIVIDE, false, false);
+  case OP_POWER:
+    return binary(b, TR_POWER, false, false);
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+    return binary(b, TR_EQUAL + (op - OP_EQUAL), false, true);
+  case OP_NEGATE:
+    return unary(b, TR_NEGATE, false, false);
+  case OP_ABS:
+    return unary(b, TR_ABS, false, false);
+  case OP_INT:
+    return unary(b, TR_INT, false, false);
+  case OP_SIN:
+    return unary(b, TR_SIN, false, false);
+  case OP_COS:
+    return unary(b, TR_COS, false, false);
+  case OP_TAN:
+    return unary(b, TR_TAN, false, false);
+  case OP_SQR:
+    return unary(b, TR_SQR, false, false);
+
+  case OP_ADD_INT:
+    return binary(b, TR_ADD_INT, true, true);
+  case OP_SUBTRACT_INT:
+    return binary(b, TR_SUBTRACT_INT, true, true);
+  case OP_MULTIPLY_INT:
+    return binary(b, TR_MULTIPLY_INT, true, true);
+  case OP_COMPARE_INT:
+    return binary(b, TR_EQUAL_INT + (arg - OP_EQUAL), true, true);
+  case OP_AND:
+    return binary(b, TR_AND, true, true);
+  case OP_OR:
+    return binary(b, TR_OR, true, true);
+  case OP_NEGATE_INT:
+    return unary(b, TR_NEGATE_INT, true, true);
+  case OP_NOT:
+    return unary(b, TR_NOT, true, true);
+
+  case OP_PEEK:
+    return unary(b, TR_PEEK, true, true);
+  case OP_POKE: {
+    if (b->depth < 2 || !b->stack[b->depth - 2].integer ||
+        !b->stack[b->depth - 1].integer)
+      return false;
+    int at = emit(b, TR_POKE);
+    if (at < 0)
+      return false;
+    b->ops[at].a = b->stack[b->depth - 2];
+    b->ops[at].b = b->stack[b->depth - 1];
+    b->depth -= 2;
+    return true;
+  }
+
+  case OP_JUMP:
+    return jump(b, TR_JUMP, arg);
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    return conditional_jump(b, op == OP_JUMP_IF_TRUE, arg);
+  case OP_FOR:
+    return for_loop(b, vars[arg], pc + 2);
+  case OP_NEXT:
+    return next_loop(b, arg < 0 ? NULL : vars[arg], pc);
+  case OP_MARK_FOR: {
+    int at = emit(b, TR_MARK_FOR);
+    if (at < 0)
+      return false;
+    b->ops[at].dst = variable(vars[arg], true);
+    return true;
+  }
+  case OP_DROP_FOR: {
+    int at = emit(b, TR_DROP_FOR);
+    if (at < 0)
+      return false;
+    b->ops[at].a = variable(vars[arg], true);
+    return true;
+  }
+
+  default:
+    return false;
+  }
+}
+
+/* Translate the loop code in order. An instruction the trace cannot run
+ * becomes an exit, and the rest of its statement is skipped up to the
+ * next point where the VM stack is empty. */
+static bool translate_loop(Builder *b) {
+  bool skipping = false;
+  int depth = 0; /* VM stack depth while skipping */
+
+  for (int pc = b->head; pc < b->end;) {
+    int pops, pushes, length;
+    if (!stack_effect(b->code, pc, &pops, &pushes, &length) ||
+        pc + length > b->end)
+      return false;
+
+    if (skipping) {
+      if (depth < pops)
+        return false;
+      depth += pushes - pops;
+      skipping = depth > 0;
+    } else {
+      if (b->depth == 0) {
+        b->restart = pc;
+        b->index_of[pc - b->head] = b->op_count;
+      }
+      if (!translate(b, pc)) {
+        if (b->failed || b->depth < pops)
+          return false;
+        emit_exit(b, b->restart);
+        depth = b->depth - pops + pushes;
+        b->depth = 0;
+        skipping = depth > 0;
+      }
+    }
+    pc += length;
+  }
+
+  if (skipping || b->depth != 0)
+    return false;
+  emit_exit(b, b->end);
+  return !b->failed;
+}
+
+static TraceOperand address(Trace *trace, int registers, const Operand *o) {
+  TraceOperand operand = {NULL};
+  TraceCell *cell;
+
+  switch (o->source) {
+  case FROM_NONE:
+    return operand;
+  case FROM_VARIABLE:
+    if (o->integer) {
+      operand.integer = &o->var->value.integer;
+    } else {
+      operand.number = &o->var->value.number;
+    }
+    return operand;
+  case FROM_REGISTER:
+    cell = &trace->cells[o->index];
+    break;
+  default:
+    cell = &trace->cells[registers + o->index];
+    break;
+  }
+  if (o->integer) {
+    operand.integer = &cell->integer;
+  } else {
+    operand.number = &cell->number;
+  }
+  return operand;
+}
+
+/* Resolve jump targets and operand addresses into the finished trace */
+static Trace *finish(Builder *b) {
+  /* Jumps out of the loop go through an exit of their own */
+  int count = b->op_count;
+  for (int i = 0; i < count; i++) {
+    PendingOp *p = &b->ops[i];
+    if (p->target_pc < 0)
+      continue;
+    int index = -1;
+    if (p->target_pc >= b->head && p->target_pc < b->end) {
+      index = b->index_of[p->target_pc - b->head];
+    }
+    if (index < 0) {
+      index = b->op_count;
+      emit_exit(b, b->ops[i].target_pc);
+      if (b->failed)
+        return NULL;
+      p = &b->ops[i];
+    }
+    p->op.target = index;
+    p->op.back = index <= i;
+  }
+
+  Trace *trace = safe_malloc(sizeof(Trace));
+  if (!trace)
+    return NULL;
+  trace->head = b->head;
+  trace->native = NULL;
+  trace->op_count = b->op_count;
+  trace->cell_count = b->registers + b->constant_count;
+  trace->range_count = b->range_count;
+  trace->loop_var = b->loop_var;
+  trace->ops = safe_malloc(b->op_count * sizeof(TraceOp));
+  trace->cells = safe_malloc((trace->cell_count ? trace->cell_count : 1) *
+                             sizeof(TraceCell));
+  trace->ranges = safe_malloc((b->range_count ? b->range_count : 1) *
+                              sizeof(TraceRange));
+  if (!trace->ops || !trace->cells || !trace->ranges) {
+    safe_free(trace->ops);
+    safe_free(trace->cells);
+    safe_free(trace->ranges);
+    safe_free(trace);
+    return NULL;
+  }
+  if (b->range_count) {
+    memcpy(trace->ranges, b->ranges, b->range_count * sizeof(TraceRange));
+  }
+
+  if (b->constant_count) {
+    memcpy(trace->cells + b->registers, b->constants,
+           b->constant_count * sizeof(TraceCell));
+  }
+  for (int i = 0; i < b->op_count; i++) {
+    const PendingOp *p = &b->ops[i];
+    TraceOp *op = &trace->ops[i];
+    *op = p->op;
+    op->dst = address(trace, b->registers, &p->dst);
+    op->a = address(trace, b->registers, &p->a);
+    op->b = address(trace, b->registers, &p->b);
+  }
+  return trace;
+}
+
+/* Build the trace of the loop closed by the backward jump at site, with
+ * bounds checks hoisted out of it if possible. Returns NULL if it cannot
+ * be traced. */
+static Trace *build(Interpreter *interp, int site, int head, bool hoist) {
+  Bytecode *bc = &interp->bytecode;
+  int pops, pushes, length;
+  if (head < 0 || head > site ||
+      !stack_effect(bc->code, site, &pops, &pushes, &length))
+    return NULL;
+
+  Builder b;
+  memset(&b, 0, sizeof(b));
+  b.interp = interp;
+  b.code = bc->code;
+  b.head = head;
+  b.end = site + length;
+  b.site = site;
+  b.restart = head;
+  b.index_of = safe_malloc((b.end - head) * sizeof(int));
+  if (!b.index_of)
+    return NULL;
+  for (int i = 0; i < b.end - head; i++) {
+    b.index_of[i] = -1;
+  }
+  /* The VM has just decided to run the loop closed at site again */
+  if (bc->code[site] == OP_NEXT && interp->for_depth > 0 &&
+      interp->for_stack[interp->for_depth - 1].body_pc == head) {
+    b.loop_var = interp->for_stack[interp->for_depth - 1].var;
+  }
+  if (hoist) {
+    find_writes(&b);
+  }
+
+  Trace *trace = NULL;
+  /* A loop whose first statement already leaves is not worth a trace */
+  if (translate_loop(&b) && b.ops[0].op.op != TR_EXIT) {
+    trace = finish(&b);
+  }
+#ifdef CFBASIC_JIT
+  if (trace) {
+    trace->native = jit_compile(trace);
+  }
+#endif
+  safe_free(b.index_of);
+  safe_free(b.ops);
+  safe_free(b.constants);
+  safe_free(b.written);
+  safe_free(b.ranges);
+  return trace;
+}
+
+/* Hand the VM back the pc op leaves the trace at. Lines are not tracked
+ * inside the trace. */
+static int leave(Interpreter *interp, const TraceOp *op) {
+  interp->current_line = line_at(&interp->bytecode, op->exit);
+  return op->exit;
+}
+
+/* As OP_FOR. Returns false when there is no room for the loop. */
+static bool enter_loop(Interpreter *interp, const TraceOp *op) {
+  Variable *var = op->var;
+  int depth = interp->for_depth;
+  while (depth > 0 && interp->for_stack[depth - 1].var != var) {
+    depth--;
+  }
+  depth = depth > 0 ? depth - 1 : interp->for_depth;
+  if (depth == MAX_FOR_DEPTH)
+    return false;
+
+  ForLoop *loop = &interp->for_stack[depth];
+  interp->for_depth = depth + 1;
+  loop->var = var;
+  if (var->type == VAR_INTEGER) {
+    loop->integer_limit = *op->a.integer;
+    loop->integer_step = *op->b.integer;
+  } else {
+    loop->limit = *op->a.number;
+    loop->step = *op->b.number;
+  }
+  loop->body_pc = op->loop_pc;
+  loop->line = op->line;
+  return true;
+}
+
+/* As OP_NEXT, for the innermost loop only. Returns 1 to run the body
+ * again, 0 when the loop is done and -1 to leave the trace. */
+static int next_iteration(Interpreter *interp, const TraceOp *op) {
+  int depth = interp->for_depth;
+  if (depth == 0 || interp->break_requested)
+    return -1;
+  ForLoop *loop = &interp->for_stack[depth - 1];
+  Variable *var = loop->var;
+  if ((op->var && var != op->var) || loop->body_pc != op->loop_pc)
+    return -1;
+
+  bool again;
+  if (var->type == VAR_INTEGER) {
+    int64_t value = (int64_t)var->value.integer + loop->integer_step;
+    again = loop->integer_step >= 0 ? value <= loop->integer_limit
+                                    : value >= loop->integer_limit;
+    if (value >= INT32_MIN && value <= INT32_MAX) {
+      var->value.integer = (int32_t)value;
+    }
+  } else {
+    double value = var->value.number + loop->step;
+    var->value.number = value;
+    again = loop->step >= 0 ? value <= loop->limit : value >= loop->limit;
+  }
+
+  if (!again) {
+    interp->for_depth = depth - 1;
+    return 0;
+  }
+  return 1;
+}
+
+#define COMPARE(x, y) (((x) > (y)) - ((x) < (y)))
+
+/* Like the VM, GCC and Clang dispatch through a table of label addresses
+ * and other compilers through the switch */
+#if defined(__GNUC__) && !defined(VM_NO_THREADING)
+#define TRACE_THREADED
+#define TRACE_CASE(op) case op: L_##op
+#define TRACE_DISPATCH goto *dispatch[ip->op]
+#else
+#define TRACE_CASE(op) case op
+#define TRACE_DISPATCH continue
+#endif
+
+/* Taken jump, checking for BREAK on the way back to an earlier op */
+#define TRACE_BRANCH                                                           \
+  if (ip->back && interp->break_requested)                                     \
+    goto exit;                                                                 \
+  ip = ops + ip->target;                                                       \
+  TRACE_DISPATCH
+
+/* Run the trace until an op leaves it. Returns the pc to resume at. */
+static int run(Interpreter *interp, const Trace *trace) {
+  const TraceOp *ops = trace->ops;
+  const TraceOp *ip = ops;
+
+#ifdef TRACE_THREADED
+  static const void *const dispatch[] = {
+      [TR_MOVE_NUMBER] = &&L_TR_MOVE_NUMBER,
+      [TR_MOVE_INTEGER] = &&L_TR_MOVE_INTEGER,
+      [TR_TO_NUMBER] = &&L_TR_TO_NUMBER,
+      [TR_TO_INTEGER] = &&L_TR_TO_INTEGER,
+      [TR_ADD] = &&L_TR_ADD,
+      [TR_SUBTRACT] = &&L_TR_SUBTRACT,
+      [TR_MULTIPLY] = &&L_TR_MULTIPLY,
+      [TR_DIVIDE] = &&L_TR_DIVIDE,
+      [TR_POWER] = &&L_TR_POWER,
+      [TR_NEGATE] = &&L_TR_NEGATE,
+      [TR_ABS] = &&L_TR_ABS,
+      [TR_INT] = &&L_TR_INT,
+      [TR_SIN] = &&L_TR_SIN,
+      [TR_COS] = &&L_TR_COS,
+      [TR_TAN] = &&L_TR_TAN,
+      [TR_SQR] = &&L_TR_SQR,
+      [TR_EQUAL] = &&L_TR_EQUAL,
+      [TR_NOT_EQUAL] = &&L_TR_NOT_EQUAL,
+      [TR_LESS] = &&L_TR_LESS,
+      [TR_GREATER] = &&L_TR_GREATER,
+      [TR_LESS_EQUAL] = &&L_TR_LESS_EQUAL,
+      [TR_GREATER_EQUAL] = &&L_TR_GREATER_EQUAL,
+      [TR_ADD_INT] = &&L_TR_ADD_INT,
+      [TR_SUBTRACT_INT] = &&L_TR_SUBTRACT_INT,
+      [TR_MULTIPLY_INT] = &&L_TR_MULTIPLY_INT,
+      [TR_NEGATE_INT] = &&L_TR_NEGATE_INT,
+      [TR_EQUAL_INT] = &&L_TR_EQUAL_INT,
+      [TR_NOT_EQUAL_INT] = &&L_TR_NOT_EQUAL_INT,
+      [TR_LESS_INT] = &&L_TR_LESS_INT,
+      [TR_GREATER_INT] = &&L_TR_GREATER_INT,
+      [TR_LESS_EQUAL_INT] = &&L_TR_LESS_EQUAL_INT,
+      [TR_GREATER_EQUAL_INT] = &&L_TR_GREATER_EQUAL_INT,
+      [TR_AND] = &&L_TR_AND,
+      [TR_OR] = &&L_TR_OR,
+      [TR_NOT] = &&L_TR_NOT,
+      [TR_PEEK] = &&L_TR_PEEK,
+      [TR_POKE] = &&L_TR_POKE,
+      [TR_INDEX] = &&L_TR_INDEX,
+      [TR_INDEX_UNCHECKED] = &&L_TR_INDEX_UNCHECKED,
+      [TR_LOAD_ELEMENT_NUMBER] = &&L_TR_LOAD_ELEMENT_NUMBER,
+      [TR_LOAD_ELEMENT_INTEGER] = &&L_TR_LOAD_ELEMENT_INTEGER,
+      [TR_STORE_ELEMENT_NUMBER] = &&L_TR_STORE_ELEMENT_NUMBER,
+      [TR_STORE_ELEMENT_INTEGER] = &&L_TR_STORE_ELEMENT_INTEGER,
+      [TR_JUMP] = &&L_TR_JUMP,
+      [TR_JUMP_IF_FALSE] = &&L_TR_JUMP_IF_FALSE,
+      [TR_JUMP_IF_TRUE] = &&L_TR_JUMP_IF_TRUE,
+      [TR_JUMP_IF_FALSE_INT] = &&L_TR_JUMP_IF_FALSE_INT,
+      [TR_JUMP_IF_TRUE_INT] = &&L_TR_JUMP_IF_TRUE_INT,
+      [TR_FOR] = &&L_TR_FOR,
+      [TR_NEXT] = &&L_TR_NEXT,
+      [TR_MARK_FOR] = &&L_TR_MARK_FOR,
+      [TR_DROP_FOR] = &&L_TR_DROP_FOR,
+      [TR_EXIT] = &&L_TR_EXIT,
+  };
+#endif
+
+  for (;;) {
+    switch (ip->op) {
+    TRACE_CASE(TR_MOVE_NUMBER):
+      *ip->dst.number = *ip->a.number;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_MOVE_INTEGER):
+      *ip->dst.integer = *ip->a.integer;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_TO_NUMBER):
+      *ip->dst.number = *ip->a.integer;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_TO_INTEGER): {
+      double x = floor(*ip->a.number);
+      if (!(x >= -2147483648.0 && x <= 2147483647.0))
+        goto exit;
+      *ip->dst.integer = (int32_t)x;
+      ip++;
+      TRACE_DISPATCH;
+    }
+
+    TRACE_CASE(TR_ADD):
+      *ip->dst.number = *ip->a.number + *ip->b.number;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_SUBTRACT):
+      *ip->dst.number = *ip->a.number - *ip->b.number;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_MULTIPLY):
+      *ip->dst.number = *ip->a.number * *ip->b.number;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_DIVIDE):
+      if (*ip->b.number == 0)
+        goto exit;
+      *ip->dst.number = *ip->a.number / *ip->b.number;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_POWER): {
+      double x = pow(*ip->a.number, *ip->b.number);
+      if (isnan(x))
+        goto exit;
+      *ip->dst.number = x;
+      ip++;
+      TRACE_DISPATCH;
+    }
+
+    TRACE_CASE(TR_NEGATE):
+      *ip->dst.number = -*ip->a.number;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_ABS):
+      *ip->dst.number = fabs(*ip->a.number);
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_INT):
+      *ip->dst.number = floor(*ip->a.number);
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_SIN):
+      *ip->dst.number = sin(*ip->a.number);
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_COS):
+      *ip->dst.number = cos(*ip->a.number);
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_TAN):
+      *ip->dst.number = tan(*ip->a.number);
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_SQR):
+      if (*ip->a.number < 0)
+        goto exit;
+      *ip->dst.number = sqrt(*ip->a.number);
+      ip++;
+      TRACE_DISPATCH;
+
+    /* Comparisons go through COMPARE as in the VM, which decides how a
+     * NaN compares */
+    TRACE_CASE(TR_EQUAL):
+      *ip->dst.integer = COMPARE(*ip->a.number, *ip->b.number) == 0 ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_NOT_EQUAL):
+      *ip->dst.integer = COMPARE(*ip->a.number, *ip->b.number) != 0 ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_LESS):
+      *ip->dst.integer = COMPARE(*ip->a.number, *ip->b.number) < 0 ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_GREATER):
+      *ip->dst.integer = COMPARE(*ip->a.number, *ip->b.number) > 0 ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_LESS_EQUAL):
+      *ip->dst.integer = COMPARE(*ip->a.number, *ip->b.number) <= 0 ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_GREATER_EQUAL):
+      *ip->dst.integer = COMPARE(*ip->a.number, *ip->b.number) >= 0 ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_ADD_INT): {
+      int64_t x = (int64_t)*ip->a.integer + *ip->b.integer;
+      if (x < INT32_MIN || x > INT32_MAX)
+        goto exit;
+      *ip->dst.integer = (int32_t)x;
+      ip++;
+      TRACE_DISPATCH;
+    }
+
+    TRACE_CASE(TR_SUBTRACT_INT): {
+      int64_t x = (int64_t)*ip->a.integer - *ip->b.integer;
+      if (x < INT32_MIN || x > INT32_MAX)
+        goto exit;
+      *ip->dst.integer = (int32_t)x;
+      ip++;
+      TRACE_DISPATCH;
+    }
+
+    TRACE_CASE(TR_MULTIPLY_INT): {
+      int64_t x = (int64_t)*ip->a.integer * *ip->b.integer;
+      if (x < INT32_MIN || x > INT32_MAX)
+        goto exit;
+      *ip->dst.integer = (int32_t)x;
+      ip++;
+      TRACE_DISPATCH;
+    }
+
+    TRACE_CASE(TR_NEGATE_INT):
+      if (*ip->a.integer == INT32_MIN)
+        goto exit;
+      *ip->dst.integer = -*ip->a.integer;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_EQUAL_INT):
+      *ip->dst.integer = *ip->a.integer == *ip->b.integer ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_NOT_EQUAL_INT):
+      *ip->dst.integer = *ip->a.integer != *ip->b.integer ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_LESS_INT):
+      *ip->dst.integer = *ip->a.integer < *ip->b.integer ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_GREATER_INT):
+      *ip->dst.integer = *ip->a.integer > *ip->b.integer ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_LESS_EQUAL_INT):
+      *ip->dst.integer = *ip->a.integer <= *ip->b.integer ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_GREATER_EQUAL_INT):
+      *ip->dst.integer = *ip->a.integer >= *ip->b.integer ? -1 : 0;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_AND):
+      *ip->dst.integer = *ip->a.integer & *ip->b.integer;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_OR):
+      *ip->dst.integer = *ip->a.integer | *ip->b.integer;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_NOT):
+      *ip->dst.integer = ~*ip->a.integer;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_PEEK):
+      *ip->dst.integer = interp->ram[(uint16_t)*ip->a.integer];
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_POKE): {
+      uint16_t address = (uint16_t)*ip->a.integer;
+      /* The VM updates the screen for these */
+      if (interp->editor && (address == 53280 || address == 53281 ||
+                             (address >= 1024 && address <= 2023)))
+        goto exit;
+      interp->ram[address] = (uint8_t)*ip->b.integer;
+      ip++;
+      TRACE_DISPATCH;
+    }
+
+    TRACE_CASE(TR_INDEX): {
+      const ArrayDimension *dimension = &ip->array->dimensions[ip->dimension];
+      int32_t subscript = *ip->a.integer;
+      if (subscript < 0 || subscript >= dimension->size)
+        goto exit;
+      *ip->dst.integer = *ip->b.integer + subscript * dimension->stride;
+      ip++;
+      TRACE_DISPATCH;
+    }
+
+    TRACE_CASE(TR_INDEX_UNCHECKED):
+      *ip->dst.integer =
+          *ip->b.integer +
+          *ip->a.integer * ip->array->dimensions[ip->dimension].stride;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_LOAD_ELEMENT_NUMBER):
+      *ip->dst.number = number_canonical(
+          ((const double *)ip->array->elements)[*ip->a.integer]);
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_LOAD_ELEMENT_INTEGER):
+      *ip->dst.integer =
+          ((const int32_t *)ip->array->elements)[*ip->a.integer];
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_STORE_ELEMENT_NUMBER):
+      ((double *)ip->array->elements)[*ip->a.integer] =
+          number_canonical(*ip->b.number);
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_STORE_ELEMENT_INTEGER):
+      ((int32_t *)ip->array->elements)[*ip->a.integer] = *ip->b.integer;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_JUMP):
+      TRACE_BRANCH;
+
+    TRACE_CASE(TR_JUMP_IF_FALSE):
+      if (*ip->a.number == 0) {
+        TRACE_BRANCH;
+      }
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_JUMP_IF_TRUE):
+      if (*ip->a.number != 0) {
+        TRACE_BRANCH;
+      }
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_JUMP_IF_FALSE_INT):
+      if (*ip->a.integer == 0) {
+        TRACE_BRANCH;
+      }
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_JUMP_IF_TRUE_INT):
+      if (*ip->a.integer != 0) {
+        TRACE_BRANCH;
+      }
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_FOR):
+      if (!enter_loop(interp, ip))
+        goto exit;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_NEXT):
+      switch (next_iteration(interp, ip)) {
+      case 0:
+        ip++;
+        TRACE_DISPATCH;
+      case 1:
+        ip = ops + ip->target;
+        TRACE_DISPATCH;
+      default:
+        goto exit;
+      }
+
+    TRACE_CASE(TR_MARK_FOR):
+      *ip->dst.integer = interp->for_depth;
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_DROP_FOR):
+      if (interp->for_depth > *ip->a.integer) {
+        interp->for_depth = *ip->a.integer;
+      }
+      ip++;
+      TRACE_DISPATCH;
+
+    TRACE_CASE(TR_EXIT):
+      goto exit;
+    }
+  }
+
+exit:
+  return leave(interp, ip);
+}
+
+int trace_step(Interpreter *interp, const TraceOp *op) {
+  switch (op->op) {
+  case TR_TO_INTEGER: {
+    double x = floor(*op->a.number);
+    if (!(x >= -2147483648.0 && x <= 2147483647.0))
+      return -1;
+    *op->dst.integer = (int32_t)x;
+    return 0;
+  }
+  case TR_POWER: {
+    double x = pow(*op->a.number, *op->b.number);
+    if (isnan(x))
+      return -1;
+    *op->dst.number = x;
+    return 0;
+  }
+  case TR_INT:
+    *op->dst.number = floor(*op->a.number);
+    return 0;
+  case TR_SIN:
+    *op->dst.number = sin(*op->a.number);
+    return 0;
+  case TR_COS:
+    *op->dst.number = cos(*op->a.number);
+    return 0;
+  case TR_TAN:
+    *op->dst.number = tan(*op->a.number);
+    return 0;
+  case TR_FOR:
+    return enter_loop(interp, op) ? 0 : -1;
+  case TR_NEXT:
+    return next_iteration(interp, op);
+  default:
+    return -1;
+  }
+}
+
+/* Whether the subscripts the trace does not check stay in bounds for as
+ * long as it runs. Both ends of the control variable's run are checked,
+ * which covers a loop counting either way. */
+static bool in_bounds(const Interpreter *interp, const Trace *trace) {
+  const ForLoop *loop = NULL;
+  if (trace->range_count && trace->loop_var) {
+    if (interp->for_depth == 0)
+      return false;
+    loop = &interp->for_stack[interp->for_depth - 1];
+    if (loop->var != trace->loop_var || loop->body_pc != trace->head)
+      return false;
+  }
+  for (int i = 0; i < trace->range_count; i++) {
+    const TraceRange *range = &trace->ranges[i];
+    bool integer = range->var->type == VAR_INTEGER;
+    double first = integer ? range->var->value.integer
+                           : range->var->value.number;
+    double last = first;
+    if (range->var == trace->loop_var) {
+      last = integer ? loop->integer_limit : loop->limit;
+    }
+    first = floor(first + range->offset);
+    last = floor(last + range->offset);
+    if (!(first >= 0 && first < range->size && last >= 0 &&
+          last < range->size))
+      return false;
+  }
+  return true;
+}
+
+int trace_enter(Interpreter *interp, int site, int head) {
+  Bytecode *bc = &interp->bytecode;
+  int state = bc->back_edges[site];
+
+  if (state >= 0) {
+    /* The loop just turned hot */
+    Trace *trace = build(interp, site, head, true);
+    if (trace && bc->trace_count == bc->trace_capacity) {
+      int capacity = bc->trace_capacity ? bc->trace_capacity * 2 : 16;
+      Trace **traces =
+          safe_realloc(bc->traces, bc->trace_capacity * sizeof(Trace *),
+                       capacity * sizeof(Trace *));
+      if (traces) {
+        bc->traces = traces;
+        bc->trace_capacity = capacity;
+      } else {
+        free_trace(trace);
+        trace = NULL;
+      }
+    }
+    if (!trace) {
+      bc->back_edges[site] = LOOP_UNTRACEABLE;
+      return head;
+    }
+    bc->traces[bc->trace_count] = trace;
+    state = bc->back_edges[site] = LOOP_TRACE(bc->trace_count++);
+  }
+
+  Trace **slot = &bc->traces[LOOP_TRACE(state)];
+  /* A NEXT shared by several FORs may be closing another loop */
+  if ((*slot)->head != head || interp->break_requested)
+    return head;
+  if (!in_bounds(interp, *slot)) {
+    /* The loop may count past the end of an array yet leave before it
+     * gets there, so its subscripts are checked where they are used from
+     * now on */
+    Trace *checked = build(interp, site, head, false);
+    if (!checked)
+      return head;
+    free_trace(*slot);
+    *slot = checked;
+  }
+  const Trace *trace = *slot;
+#ifdef CFBASIC_JIT
+  if (trace->native)
+    return leave(interp, &trace->ops[trace->native->entry(interp)]);
+#endif
+  return run(interp, trace);
+}
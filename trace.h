@@ -0,0 +1,154 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "interpreter.h"
+
+/* Hot loop tracing. The VM counts the backward jumps of program loops;
+ * once one has been taken HOT_LOOP_THRESHOLD times, the code of the loop
+ * is translated into a trace and later iterations run that instead.
+ *
+ * A trace works on untagged values: variable types follow from their
+ * names and every stack slot's type is known when the trace is built, so
+ * only what can still change at run time is guarded. Integer arithmetic
+ * that would overflow, operations that would raise an error and loop
+ * frames that do not match leave the trace, and so does any instruction
+ * a trace cannot run. The VM then resumes at the last point where its
+ * stack was empty, which is never past a side effect of the statement
+ * that left, and repeats the work the ordinary way. */
+
+#define HOT_LOOP_THRESHOLD 1000
+
+/* Back-edge states besides a count below the threshold */
+#define LOOP_UNTRACEABLE -1
+/* Traced by bc->traces[index]; the mapping is its own inverse */
+#define LOOP_TRACE(index) (-2 - (index))
+
+typedef enum {
+  TR_MOVE_NUMBER,
+  TR_MOVE_INTEGER,
+  TR_TO_NUMBER,
+  TR_TO_INTEGER, /* Guarded: the number must fit */
+
+  TR_ADD,
+  TR_SUBTRACT,
+  TR_MULTIPLY,
+  TR_DIVIDE, /* Guarded: divisor is not zero */
+  TR_POWER,  /* Guarded: result is a number */
+  TR_NEGATE,
+  TR_ABS,
+  TR_INT,
+  TR_SIN,
+  TR_COS,
+  TR_TAN,
+  TR_SQR, /* Guarded: operand is not negative */
+  TR_EQUAL, /* Comparisons in the order of OP_EQUAL.. */
+  TR_NOT_EQUAL,
+  TR_LESS,
+  TR_GREATER,
+  TR_LESS_EQUAL,
+  TR_GREATER_EQUAL,
+
+  /* Integer operators, guarded against overflow */
+  TR_ADD_INT,
+  TR_SUBTRACT_INT,
+  TR_MULTIPLY_INT,
+  TR_NEGATE_INT,
+  TR_EQUAL_INT,
+  TR_NOT_EQUAL_INT,
+  TR_LESS_INT,
+  TR_GREATER_INT,
+  TR_LESS_EQUAL_INT,
+  TR_GREATER_EQUAL_INT,
+  TR_AND,
+  TR_OR,
+  TR_NOT,
+
+  TR_PEEK,
+  TR_POKE, /* Guarded: the address has no side effects on the screen */
+
+  /* Array elements. INDEX adds subscript a times the stride of its
+   * dimension to the index so far in b; the other ops take the index in
+   * a and a value to store in b. */
+  TR_INDEX,           /* Guarded: the subscript is in bounds */
+  TR_INDEX_UNCHECKED, /* In bounds as checked on entry, see TraceRange */
+  TR_LOAD_ELEMENT_NUMBER,
+  TR_LOAD_ELEMENT_INTEGER,
+  TR_STORE_ELEMENT_NUMBER,
+  TR_STORE_ELEMENT_INTEGER,
+
+  TR_JUMP,
+  TR_JUMP_IF_FALSE, /* On a number */
+  TR_JUMP_IF_TRUE,
+  TR_JUMP_IF_FALSE_INT,
+  TR_JUMP_IF_TRUE_INT,
+  TR_FOR,  /* Guarded: there is room for the loop */
+  TR_NEXT, /* Guarded: the innermost loop is the expected one */
+  TR_MARK_FOR, /* FOR depth into dst, as OP_MARK_FOR */
+  TR_DROP_FOR, /* Back to the FOR depth in a, as OP_DROP_FOR */
+  TR_EXIT
+} TraceOpcode;
+
+/* Operands are addresses fixed when the trace is built: a variable's
+ * value, a constant or a register standing for a VM stack slot */
+typedef union {
+  double *number;
+  int32_t *integer;
+} TraceOperand;
+
+typedef struct {
+  TraceOpcode op;
+  TraceOperand dst, a, b;
+  Variable *var;     /* FOR, and NEXT unless it takes the innermost loop */
+  Array *array;      /* Element ops */
+  int dimension;     /* INDEX: position of the subscript */
+  ProgramLine *line; /* FOR: line of the loop, current at each iteration */
+  int target;        /* Jumps and NEXT: index of the next op when taken */
+  int loop_pc;       /* FOR and NEXT: first pc of the loop body */
+  bool back;         /* Jump back to an earlier op, which checks for BREAK */
+  int exit;          /* pc the VM resumes at when the op leaves the trace */
+} TraceOp;
+
+typedef union {
+  double number;
+  int32_t integer;
+} TraceCell;
+
+/* Subscript whose bounds are checked when the trace is entered rather
+ * than at every access. It is floor(var + offset), and var changes in the
+ * trace only if it is the control variable of the traced loop, which
+ * stays between its value on entry and the loop's limit. */
+typedef struct {
+  Variable *var;
+  double offset;
+  int32_t size; /* The subscript must be below it */
+} TraceRange;
+
+typedef struct Trace {
+  int head; /* pc of the first instruction of the loop */
+  TraceOp *ops;
+  int op_count;
+  TraceCell *cells; /* Registers followed by constants */
+  int cell_count;
+  TraceRange *ranges;
+  int range_count;
+  Variable *loop_var; /* Control variable of the traced FOR loop, if any */
+  struct JitCode *native; /* Machine code when built with JIT=1, see jit.h */
+} Trace;
+
+void trace_free(Bytecode *bc);
+
+/* Allocate the back-edge counters for a freshly compiled program,
+ * dropping the traces of the previous one */
+void trace_reset(Bytecode *bc);
+
+/* Called when the backward jump at site has reached the threshold or is
+ * traced: builds the trace on first use and runs it. Returns the pc the
+ * VM continues at, which is head when the loop is not traced. */
+int trace_enter(Interpreter *interp, int site, int head);
+
+/* Run one op as the trace interpreter would, for native code that leaves
+ * it to C. Returns -1 when the op leaves the trace, 1 when it jumps to its
+ * target and 0 when it falls through. */
+int trace_step(Interpreter *interp, const TraceOp *op);
+
+#endif /* TRACE_H */
@@ -75,6 +75,15 @@ char *str_duplicate(const char *str) {
   return dup;
 }
 
+char *str_duplicate_n(const char *str, size_t length) {
+  char *dup = safe_malloc(length + 1);
+  if (dup) {
+    memcpy(dup, str, length);
+    dup[length] = '\0';
+  }
+  return dup;
+}
+
 char *str_upper(const char *str) {
   if (!str)
     return NULL;
@@ -102,6 +111,17 @@ int str_compare_nocase(const char *s1, const char *s2) {
   return toupper((unsigned char)*s1) - toupper((unsigned char)*s2);
 }
 
+/* Compare at most n characters, stopping early at a NUL */
+int str_compare_nocase_n(const char *s1, const char *s2, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    int c1 = toupper((unsigned char)s1[i]);
+    int c2 = toupper((unsigned char)s2[i]);
+    if (c1 != c2 || c1 == 0)
+      return c1 - c2;
+  }
+  return 0;
+}
+
 void error(const char *format, ...) {
   va_list args;
   va_start(args, format);
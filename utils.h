@@ -17,8 +17,10 @@ size_t get_free_memory(void);
 
 /* String utilities */
 char *str_duplicate(const char *str);
+char *str_duplicate_n(const char *str, size_t length);
 char *str_upper(const char *str);
 int str_compare_nocase(const char *s1, const char *s2);
+int str_compare_nocase_n(const char *s1, const char *s2, size_t n);
 
 /* Error handling */
 void error(const char *format, ...);
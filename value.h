@@ -0,0 +1,94 @@
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Values in one 64-bit word. A number is the double itself. Any other
+ * value is a NaN no arithmetic produces: the sign, exponent and quiet
+ * bits all set, a tag above them in bits 48-63 and a 48-bit payload.
+ *
+ * Strings are not pointers but places in one of two blocks, so that a
+ * string, with its length, fits the payload and the blocks may move:
+ * bits 16-47 are an offset and bits 0-15 the length.
+ *
+ * A NaN read from outside or copied through carries its payload, which
+ * would read as a tag, so every NaN is stored as the one NaN instead. */
+
+typedef union Value {
+  uint64_t bits;
+  double number;
+} Value;
+
+#define VALUE_TAG_SHIFT 48
+#define VALUE_BOXED 0xFFF9u       /* Tags from here up are not numbers */
+#define VALUE_INTEGER_TAG 0xFFF9u /* Payload is the int32_t in bits 0-31 */
+#define VALUE_STRING_TAG 0xFFFAu  /* In the string heap, see strheap.h */
+#define VALUE_LITERAL_TAG 0xFFFBu /* Interned, see string_intern() */
+
+#define STRING_MAX_LENGTH 0xFFFF
+
+/* Characters a number is written with in BASIC, for reading numbers
+ * without the C spellings strtod() also takes: INF, NAN(...) and hex */
+#define NUMBER_CHARS "0123456789.+-Ee"
+
+static inline unsigned value_tag(Value v) {
+  return (unsigned)(v.bits >> VALUE_TAG_SHIFT);
+}
+
+static inline bool value_is_number(Value v) {
+  return value_tag(v) < VALUE_BOXED;
+}
+
+static inline bool value_is_integer(Value v) {
+  return value_tag(v) == VALUE_INTEGER_TAG;
+}
+
+static inline bool value_is_string(Value v) {
+  return value_tag(v) == VALUE_STRING_TAG ||
+         value_tag(v) == VALUE_LITERAL_TAG;
+}
+
+static inline double number_canonical(double x) {
+  return isnan(x) ? NAN : x;
+}
+
+static inline Value number_value(double x) {
+  Value v;
+  v.number = number_canonical(x);
+  return v;
+}
+
+static inline Value integer_value(int32_t x) {
+  Value v;
+  v.bits = (uint64_t)VALUE_INTEGER_TAG << VALUE_TAG_SHIFT | (uint32_t)x;
+  return v;
+}
+
+static inline int32_t value_integer(Value v) {
+  return (int32_t)(uint32_t)v.bits;
+}
+
+/* length must be at most STRING_MAX_LENGTH */
+static inline Value string_value(unsigned tag, size_t offset, size_t length) {
+  Value v;
+  v.bits = (uint64_t)tag << VALUE_TAG_SHIFT | (uint64_t)offset << 16 | length;
+  return v;
+}
+
+static inline size_t string_offset(Value v) {
+  return (uint32_t)(v.bits >> 16);
+}
+
+static inline int32_t string_length(Value v) {
+  return (int32_t)(v.bits & 0xFFFF);
+}
+
+/* The length characters from offset from within the string s */
+static inline Value string_part(Value s, size_t from, size_t length) {
+  return string_value(value_tag(s), string_offset(s) + from, length);
+}
+
+#endif /* VALUE_H */
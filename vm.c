@@ -0,0 +1,1196 @@
+#include "vm.h"
+#include "bytecode.h"
+#include "editor.h"
+#include "trace.h"
+#include "utils.h"
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Deep enough for MAX_EXPRESSION_DEPTH nested operands */
+#define VM_STACK_SIZE 256
+
+/* Make stack[depth] a new string holding a copy of chars. Returns false
+ * when out of memory. */
+static bool new_string(Interpreter *interp, Value *stack, int depth,
+                       const char *chars, size_t length) {
+  char *copy = string_alloc(interp, stack, depth, length, &stack[depth]);
+  if (!copy)
+    return false;
+  memcpy(copy, chars, length);
+  return true;
+}
+
+static int string_compare(String a, String b) {
+  int32_t n = a.length < b.length ? a.length : b.length;
+  int cmp = n ? memcmp(a.chars, b.chars, n) : 0;
+  return cmp ? cmp : (a.length > b.length) - (a.length < b.length);
+}
+
+static void print_string(Interpreter *interp, String s) {
+  /* Handle some CBM control characters */
+  for (int32_t i = 0; i < s.length; i++) {
+    unsigned char c = (unsigned char)s.chars[i];
+    if (interp->editor) {
+      if (c == 147) { // CLR/HOME
+        editor_clear(interp->editor);
+      } else if (c == 19) { // HOME
+        editor_move_cursor(interp->editor, 0, 0);
+      } else if (c == 17) { // CSR DOWN
+        editor_move_cursor_relative(interp->editor, 1, 0);
+      } else if (c == 145) { // CSR UP
+        editor_move_cursor_relative(interp->editor, -1, 0);
+      } else if (c == 157) { // CSR LEFT
+        editor_move_cursor_relative(interp->editor, 0, -1);
+      } else if (c == 29) { // CSR RIGHT
+        editor_move_cursor_relative(interp->editor, 0, 1);
+      } else {
+        char buf[2] = {(char)c, 0};
+        editor_print(interp->editor, buf);
+      }
+    } else {
+      if (c == 147) { // CLR/HOME
+        printf("\x1b[2J\x1b[H");
+      } else if (c == 19) { // HOME
+        printf("\x1b[H");
+      } else if (c == 17) { // CSR DOWN
+        printf("\x1b[B");
+      } else if (c == 145) { // CSR UP
+        printf("\x1b[A");
+      } else if (c == 157) { // CSR LEFT
+        printf("\x1b[D");
+      } else if (c == 29) { // CSR RIGHT
+        printf("\x1b[C");
+      } else {
+        putchar(c);
+      }
+      fflush(stdout);
+    }
+  }
+}
+
+static void draw_line(Interpreter *interp, int x1, int y1, int x2, int y2) {
+  if (!interp->editor)
+    return;
+
+  // Scale from C64/C128 resolution (320x200) to terminal size
+  int tx1 = x1 * interp->editor->cols / 320;
+  int ty1 = y1 * interp->editor->rows / 200;
+  int tx2 = x2 * interp->editor->cols / 320;
+  int ty2 = y2 * interp->editor->rows / 200;
+
+  int dx = abs(tx2 - tx1);
+  int dy = abs(ty2 - ty1);
+  int sx = (tx1 < tx2) ? 1 : -1;
+  int sy = (ty1 < ty2) ? 1 : -1;
+  int err = dx - dy;
+
+  while (1) {
+    editor_plot(interp->editor, tx1, ty1, '*');
+    if (tx1 == tx2 && ty1 == ty2)
+      break;
+    int e2 = 2 * err;
+    if (e2 > -dy) {
+      err -= dy;
+      tx1 += sx;
+    }
+    if (e2 < dx) {
+      err += dx;
+      ty1 += sy;
+    }
+  }
+}
+
+static void poke(Interpreter *interp, uint16_t a, uint8_t v) {
+  interp->ram[a] = v;
+
+  if (interp->editor) {
+    if (a == 53280 || a == 53281) {
+      editor_set_background_color(interp->editor, v);
+    } else if (a >= 1024 && a <= 2023) {
+      editor_poke_char(interp->editor, a, v);
+    }
+  }
+}
+
+static bool compare(int op, int cmp) {
+  switch (op) {
+  case OP_EQUAL:
+    return cmp == 0;
+  case OP_NOT_EQUAL:
+    return cmp != 0;
+  case OP_LESS:
+    return cmp < 0;
+  case OP_GREATER:
+    return cmp > 0;
+  case OP_LESS_EQUAL:
+    return cmp <= 0;
+  default:
+    return cmp >= 0;
+  }
+}
+
+/* Conversion to an integer, as for AND, OR, NOT and % variables */
+static bool to_integer(double x, int32_t *out) {
+  x = floor(x);
+  if (x < -2147483648.0 || x > 2147483647.0)
+    return false;
+  *out = (int32_t)x;
+  return true;
+}
+
+static double as_number(const Value *v) {
+  return value_is_integer(*v) ? value_integer(*v) : v->number;
+}
+
+static void set_number(Value *v, double x) {
+  *v = number_value(x);
+}
+
+static void set_integer(Value *v, int32_t x) {
+  *v = integer_value(x);
+}
+
+/* Exact result of integer arithmetic; promotes when it overflows */
+static void set_wide(Value *v, int64_t x) {
+  if (x < INT32_MIN || x > INT32_MAX) {
+    set_number(v, (double)x);
+  } else {
+    set_integer(v, (int32_t)x);
+  }
+}
+
+/* Floating point operators and functions. Returns the error message, or
+ * NULL with the result stored. */
+static const char *number_op(int op, double a, double b, double *result) {
+  switch (op) {
+  case OP_ADD:
+    *result = a + b;
+    break;
+  case OP_SUBTRACT:
+    *result = a - b;
+    break;
+  case OP_MULTIPLY:
+    *result = a * b;
+    break;
+  case OP_DIVIDE:
+    if (b == 0)
+      return "DIVISION BY ZERO";
+    *result = a / b;
+    break;
+  case OP_POWER:
+    *result = pow(a, b);
+    if (isnan(*result))
+      return "ILLEGAL QUANTITY";
+    break;
+  case OP_NEGATE:
+    *result = -a;
+    break;
+  case OP_ABS:
+    *result = fabs(a);
+    break;
+  case OP_INT:
+    *result = floor(a);
+    break;
+  case OP_SIN:
+    *result = sin(a);
+    break;
+  case OP_COS:
+    *result = cos(a);
+    break;
+  case OP_TAN:
+    *result = tan(a);
+    break;
+  case OP_SQR:
+    if (a < 0)
+      return "ILLEGAL QUANTITY";
+    *result = sqrt(a);
+    break;
+  default:
+    return "SYNTAX";
+  }
+  return NULL;
+}
+
+/* Numeric instructions without side effects, applied to a (and b for
+ * binary operators) in place. Shared by the VM and constant folding. */
+static const char *apply_op(int op, int arg, Value *a, const Value *b) {
+  int32_t x;
+  double result;
+  const char *error;
+
+  switch (op) {
+  case OP_TO_NUMBER:
+    if (value_is_integer(*a)) {
+      set_number(a, value_integer(*a));
+    }
+    return NULL;
+  case OP_TO_INTEGER:
+    if (!value_is_integer(*a)) {
+      if (!to_integer(a->number, &x))
+        return "ILLEGAL QUANTITY";
+      set_integer(a, x);
+    }
+    return NULL;
+
+  case OP_ADD_INT:
+  case OP_SUBTRACT_INT:
+  case OP_MULTIPLY_INT:
+    if (value_is_integer(*a) && value_is_integer(*b)) {
+      int64_t i = value_integer(*a), j = value_integer(*b);
+      set_wide(a, op == OP_ADD_INT        ? i + j
+                  : op == OP_SUBTRACT_INT ? i - j
+                                          : i * j);
+    } else {
+      double p = as_number(a), q = as_number(b);
+      set_number(a, op == OP_ADD_INT        ? p + q
+                    : op == OP_SUBTRACT_INT ? p - q
+                                            : p * q);
+    }
+    return NULL;
+  case OP_NEGATE_INT:
+    if (value_is_integer(*a)) {
+      set_wide(a, -(int64_t)value_integer(*a));
+    } else {
+      set_number(a, -a->number);
+    }
+    return NULL;
+  case OP_COMPARE_INT:
+    if (value_is_integer(*a) && value_is_integer(*b)) {
+      int32_t i = value_integer(*a), j = value_integer(*b);
+      x = (i > j) - (i < j);
+    } else {
+      double p = as_number(a), q = as_number(b);
+      x = (p > q) - (p < q);
+    }
+    set_integer(a, compare(arg, x) ? -1 : 0); // BASIC true is -1
+    return NULL;
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+    x = (a->number > b->number) - (a->number < b->number);
+    set_integer(a, compare(op, x) ? -1 : 0);
+    return NULL;
+  case OP_AND:
+    set_integer(a, value_integer(*a) & value_integer(*b));
+    return NULL;
+  case OP_OR:
+    set_integer(a, value_integer(*a) | value_integer(*b));
+    return NULL;
+  case OP_NOT:
+    set_integer(a, ~value_integer(*a));
+    return NULL;
+
+  default:
+    error = number_op(op, a->number, b ? b->number : 0, &result);
+    if (!error) {
+      set_number(a, result);
+    }
+    return error;
+  }
+}
+
+bool vm_fold(int op, int arg, const Value *operands, int count,
+             Value *result) {
+  *result = operands[0];
+  return apply_op(op, arg, result, count > 1 ? &operands[1] : NULL) == NULL;
+}
+
+/* DIM the array in var with the given bounds, or with bounds of 10 when
+ * there are none, as for an array used before any DIM. The elements start
+ * out as 0 or the empty string. Returns the error message, or NULL. */
+static const char *dim_array(Variable *var, const Value *bounds, int count) {
+  if (var->value.array)
+    return "REDIM'D ARRAY";
+  int64_t total = 1;
+  for (int i = 0; i < count; i++) {
+    double bound = bounds ? as_number(&bounds[i]) : 10;
+    if (bound < 0)
+      return "ILLEGAL QUANTITY";
+    if (bound >= INT32_MAX || (total *= (int64_t)bound + 1) > INT32_MAX)
+      return "OUT OF MEMORY";
+  }
+
+  /* Header and elements in one block, the elements aligned for doubles */
+  size_t header = offsetof(Array, dimensions) + count * sizeof(ArrayDimension);
+  header = (header + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+  size_t width =
+      var->type == VAR_ARRAY_INTEGER ? sizeof(int32_t) : sizeof(Value);
+  if ((uint64_t)total > (SIZE_MAX - header) / width)
+    return "OUT OF MEMORY";
+  Array *array = safe_malloc(header + (size_t)total * width);
+  if (!array)
+    return "OUT OF MEMORY";
+  array->elements = (char *)array + header;
+  array->count = (int32_t)total;
+  array->dimension_count = count;
+  int32_t stride = 1;
+  for (int i = count - 1; i >= 0; i--) {
+    int32_t size = (bounds ? (int32_t)as_number(&bounds[i]) : 10) + 1;
+    array->dimensions[i].size = size;
+    array->dimensions[i].stride = stride;
+    stride *= size;
+  }
+  if (var->type == VAR_ARRAY_STRING) {
+    Value *elements = array->elements;
+    for (int32_t i = 0; i < array->count; i++) {
+      elements[i] = string_value(VALUE_STRING_TAG, 0, 0);
+    }
+  } else {
+    memset(array->elements, 0, (size_t)total * width);
+  }
+  var->value.array = array;
+  return NULL;
+}
+
+/* Index into the elements of array for the given subscripts. Returns the
+ * error message, or NULL with the index stored. */
+static const char *element_index(const Array *array, const Value *subscripts,
+                                 int count, int32_t *index) {
+  if (count != array->dimension_count)
+    return "BAD SUBSCRIPT";
+  int32_t at = 0;
+  for (int i = 0; i < count; i++) {
+    /* Whole, but possibly overflowed into a double */
+    double subscript = as_number(&subscripts[i]);
+    if (subscript < 0)
+      return "ILLEGAL QUANTITY";
+    if (subscript >= array->dimensions[i].size)
+      return "BAD SUBSCRIPT";
+    at += (int32_t)subscript * array->dimensions[i].stride;
+  }
+  *index = at;
+  return NULL;
+}
+
+/* BASIC 7.0 error numbers, for ER */
+static const struct {
+  const char *message;
+  int number;
+} error_numbers[] = {
+    {"FILE NOT FOUND", 4},        {"NEXT WITHOUT FOR", 10},
+    {"SYNTAX", 11},               {"RETURN WITHOUT GOSUB", 12},
+    {"OUT OF DATA", 13},          {"ILLEGAL QUANTITY", 14},
+    {"OVERFLOW", 15},             {"OUT OF MEMORY", 16},
+    {"LINE NOT FOUND", 17},       {"BAD SUBSCRIPT", 18},
+    {"REDIM'D ARRAY", 19},        {"DIVISION BY ZERO", 20},
+    {"ILLEGAL DIRECT", 21},       {"TYPE MISMATCH", 22},
+    {"STRING TOO LONG", 23},      {"FORMULA TOO COMPLEX", 25},
+    {"UNDEF'D FUNCTION", 27},     {"CAN'T RESUME", 31},
+    {"LOOP NOT FOUND", 32},       {"LOOP WITHOUT DO", 33},
+};
+
+static int error_number(const char *message) {
+  for (size_t i = 0; message && i < sizeof(error_numbers) /
+                                          sizeof(error_numbers[0]);
+       i++) {
+    if (strcmp(error_numbers[i].message, message) == 0)
+      return error_numbers[i].number;
+  }
+  return 0;
+}
+
+/* Hand the error just raised by the instruction at code[at] to the TRAP
+ * handler. Returns the handler's pc, or -1 if the error is not trapped:
+ * trapping is off, the handler is already running, or the error is not
+ * in a program line. */
+static int trap_error(Interpreter *interp, int at) {
+  if (interp->trap_line < 0 || interp->trapped || !interp->current_line)
+    return -1;
+  ProgramLine *handler = program_find_line(interp, interp->trap_line);
+  if (!handler)
+    return -1;
+
+  /* The innermost statement holding the instruction is the first one
+   * listed that ends after it and starts at or before it */
+  const Bytecode *bc = &interp->bytecode;
+  int low = 0;
+  int high = bc->statement_count;
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (bc->statements[mid].end <= at) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  while (low < bc->statement_count && bc->statements[low].start > at) {
+    low++;
+  }
+  if (low < bc->statement_count) {
+    interp->resume_pc = bc->statements[low].start;
+    interp->resume_next_pc = bc->statements[low].end;
+  } else {
+    interp->resume_pc = interp->resume_next_pc = -1;
+  }
+
+  interp->error_number = error_number(interp->error_message);
+  interp->error_line = interp->current_line->line_number;
+  interp->resume_line = interp->current_line;
+  interp->trapped = true;
+  interp->error_occurred = false;
+  safe_free(interp->error_message);
+  interp->error_message = NULL;
+  return handler->code_offset;
+}
+
+/* With GCC and Clang each handler ends by jumping straight to the next
+ * instruction's handler through a table of label addresses, so every
+ * handler gets its own indirect branch to predict. Elsewhere the switch
+ * does the dispatch. */
+#if defined(__GNUC__) && !defined(VM_NO_THREADING)
+#define VM_THREADED
+#define VM_CASE(op) case op: L_##op
+#define VM_NEXT                                                                \
+  do {                                                                         \
+    op = code[pc++];                                                           \
+    goto *dispatch[op];                                                        \
+  } while (0)
+#else
+#define VM_CASE(op) case op
+#define VM_NEXT break
+#endif
+
+/* pc to continue at after the backward jump at site to head: once the
+ * loop is hot, wherever its trace leaves off */
+static int back_edge(Interpreter *interp, int *back_edges, int site,
+                     int head) {
+  int count = back_edges[site];
+  if (count == LOOP_UNTRACEABLE ||
+      (count >= 0 && (back_edges[site] = count + 1) < HOT_LOOP_THRESHOLD))
+    return head;
+  return trace_enter(interp, site, head);
+}
+
+#define VM_ERROR(msg)                                                          \
+  do {                                                                         \
+    interpreter_error(interp, msg);                                            \
+    goto trap;                                                                 \
+  } while (0)
+
+void vm_run(Interpreter *interp, int pc) {
+  Bytecode *bc = &interp->bytecode;
+  const int32_t *code = bc->code;
+  Variable **vars = interp->variables.slots; /* Fixed once compiled */
+  Value stack[VM_STACK_SIZE];
+  int sp = 0;
+  const char *error;
+  int op;
+  /* Backward jumps within the program are counted for tracing */
+  int *back_edges = bc->back_edges;
+  int traced = back_edges ? bc->program_length : 0;
+
+#ifdef VM_THREADED
+  static const void *const dispatch[] = {
+      [OP_LINE] = &&L_OP_LINE,
+      [OP_PUSH_NUMBER] = &&L_OP_PUSH_NUMBER,
+      [OP_PUSH_INTEGER] = &&L_OP_PUSH_INTEGER,
+      [OP_PUSH_STRING] = &&L_OP_PUSH_STRING,
+      [OP_LOAD_NUMBER] = &&L_OP_LOAD_NUMBER,
+      [OP_LOAD_INTEGER] = &&L_OP_LOAD_INTEGER,
+      [OP_LOAD_STRING] = &&L_OP_LOAD_STRING,
+      [OP_STORE_NUMBER] = &&L_OP_STORE_NUMBER,
+      [OP_STORE_INTEGER] = &&L_OP_STORE_INTEGER,
+      [OP_STORE_STRING] = &&L_OP_STORE_STRING,
+      [OP_DIM] = &&L_OP_DIM,
+      [OP_ELEMENT] = &&L_OP_ELEMENT,
+      [OP_LOAD_ELEMENT_NUMBER] = &&L_OP_LOAD_ELEMENT_NUMBER,
+      [OP_LOAD_ELEMENT_INTEGER] = &&L_OP_LOAD_ELEMENT_INTEGER,
+      [OP_LOAD_ELEMENT_STRING] = &&L_OP_LOAD_ELEMENT_STRING,
+      [OP_STORE_ELEMENT_NUMBER] = &&L_OP_STORE_ELEMENT_NUMBER,
+      [OP_STORE_ELEMENT_INTEGER] = &&L_OP_STORE_ELEMENT_INTEGER,
+      [OP_STORE_ELEMENT_STRING] = &&L_OP_STORE_ELEMENT_STRING,
+      [OP_TO_NUMBER] = &&L_OP_TO_NUMBER,
+      [OP_TO_INTEGER] = &&L_OP_TO_INTEGER,
+      [OP_ADD] = &&L_OP_ADD,
+      [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+      [OP_DIVIDE] = &&L_OP_DIVIDE,
+      [OP_POWER] = &&L_OP_POWER,
+      [OP_NEGATE] = &&L_OP_NEGATE,
+      [OP_EQUAL] = &&L_OP_EQUAL,
+      [OP_NOT_EQUAL] = &&L_OP_NOT_EQUAL,
+      [OP_LESS] = &&L_OP_LESS,
+      [OP_GREATER] = &&L_OP_GREATER,
+      [OP_LESS_EQUAL] = &&L_OP_LESS_EQUAL,
+      [OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+      [OP_ADD_INT] = &&L_OP_ADD_INT,
+      [OP_SUBTRACT_INT] = &&L_OP_SUBTRACT_INT,
+      [OP_MULTIPLY_INT] = &&L_OP_MULTIPLY_INT,
+      [OP_NEGATE_INT] = &&L_OP_NEGATE_INT,
+      [OP_COMPARE_INT] = &&L_OP_COMPARE_INT,
+      [OP_AND] = &&L_OP_AND,
+      [OP_OR] = &&L_OP_OR,
+      [OP_NOT] = &&L_OP_NOT,
+      [OP_CONCAT] = &&L_OP_CONCAT,
+      [OP_STRING_COMPARE] = &&L_OP_STRING_COMPARE,
+      [OP_ABS] = &&L_OP_ABS,
+      [OP_INT] = &&L_OP_INT,
+      [OP_RND] = &&L_OP_RND,
+      [OP_SIN] = &&L_OP_SIN,
+      [OP_COS] = &&L_OP_COS,
+      [OP_TAN] = &&L_OP_TAN,
+      [OP_SQR] = &&L_OP_SQR,
+      [OP_PEEK] = &&L_OP_PEEK,
+      [OP_LEN] = &&L_OP_LEN,
+      [OP_VAL] = &&L_OP_VAL,
+      [OP_ASC] = &&L_OP_ASC,
+      [OP_CHR] = &&L_OP_CHR,
+      [OP_STR] = &&L_OP_STR,
+      [OP_LEFT] = &&L_OP_LEFT,
+      [OP_RIGHT] = &&L_OP_RIGHT,
+      [OP_MID] = &&L_OP_MID,
+      [OP_ER] = &&L_OP_ER,
+      [OP_EL] = &&L_OP_EL,
+      [OP_PRINT_NUMBER] = &&L_OP_PRINT_NUMBER,
+      [OP_PRINT_STRING] = &&L_OP_PRINT_STRING,
+      [OP_PRINT_TAB] = &&L_OP_PRINT_TAB,
+      [OP_PRINT_NEWLINE] = &&L_OP_PRINT_NEWLINE,
+      [OP_JUMP] = &&L_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+      [OP_JUMP_IF_TRUE] = &&L_OP_JUMP_IF_TRUE,
+      [OP_GOTO] = &&L_OP_GOTO,
+      [OP_GOSUB] = &&L_OP_GOSUB,
+      [OP_CALL] = &&L_OP_CALL,
+      [OP_RETURN] = &&L_OP_RETURN,
+      [OP_ON_GOTO] = &&L_OP_ON_GOTO,
+      [OP_ON_GOSUB] = &&L_OP_ON_GOSUB,
+      [OP_READ] = &&L_OP_READ,
+      [OP_RESTORE] = &&L_OP_RESTORE,
+      [OP_TRAP] = &&L_OP_TRAP,
+      [OP_RESUME] = &&L_OP_RESUME,
+      [OP_FOR] = &&L_OP_FOR,
+      [OP_NEXT] = &&L_OP_NEXT,
+      [OP_MARK_FOR] = &&L_OP_MARK_FOR,
+      [OP_DROP_FOR] = &&L_OP_DROP_FOR,
+      [OP_POKE] = &&L_OP_POKE,
+      [OP_PLOT] = &&L_OP_PLOT,
+      [OP_DRAW] = &&L_OP_DRAW,
+      [OP_CLR] = &&L_OP_CLR,
+      [OP_MEMCHK] = &&L_OP_MEMCHK,
+      [OP_ERROR] = &&L_OP_ERROR,
+      [OP_EXIT] = &&L_OP_EXIT,
+      [OP_END] = &&L_OP_END,
+  };
+#endif
+
+  interp->running = true;
+
+  for (;;) {
+    op = code[pc++];
+
+    switch (op) {
+    VM_CASE(OP_LINE):
+      interp->current_line = bc->lines[code[pc++]];
+      if (interp->break_requested) {
+        basic_print(interp, "\n? BREAK\n");
+        interp->break_requested = false;
+        goto done;
+      }
+      VM_NEXT;
+
+    VM_CASE(OP_PUSH_NUMBER):
+      set_number(&stack[sp++], bc->numbers[code[pc++]]);
+      VM_NEXT;
+
+    VM_CASE(OP_PUSH_INTEGER):
+      set_integer(&stack[sp++], code[pc++]);
+      VM_NEXT;
+
+    VM_CASE(OP_PUSH_STRING):
+      stack[sp++] = bc->strings[code[pc++]];
+      VM_NEXT;
+
+    VM_CASE(OP_LOAD_NUMBER):
+      set_number(&stack[sp++], vars[code[pc++]]->value.number);
+      VM_NEXT;
+
+    VM_CASE(OP_LOAD_INTEGER):
+      set_integer(&stack[sp++], vars[code[pc++]]->value.integer);
+      VM_NEXT;
+
+    VM_CASE(OP_LOAD_STRING):
+      stack[sp++] = vars[code[pc++]]->value.string;
+      VM_NEXT;
+
+    VM_CASE(OP_STORE_NUMBER):
+      vars[code[pc++]]->value.number = stack[--sp].number;
+      VM_NEXT;
+
+    VM_CASE(OP_STORE_INTEGER): {
+      /* Conversion is folded into the store */
+      Variable *var = vars[code[pc++]];
+      Value *v = &stack[--sp];
+      if (!value_is_integer(*v) &&
+          (error = apply_op(OP_TO_INTEGER, 0, v, NULL)) != NULL)
+        VM_ERROR(error);
+      var->value.integer = value_integer(*v);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_STORE_STRING):
+      vars[code[pc++]]->value.string = stack[--sp];
+      VM_NEXT;
+
+    VM_CASE(OP_DIM): {
+      Variable *var = vars[code[pc++]];
+      int count = code[pc++];
+      sp -= count;
+      if ((error = dim_array(var, &stack[sp], count)) != NULL)
+        VM_ERROR(error);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_ELEMENT): {
+      Variable *var = vars[code[pc++]];
+      int count = code[pc++];
+      int32_t index;
+      sp -= count;
+      if (!var->value.array && (error = dim_array(var, NULL, count)) != NULL)
+        VM_ERROR(error);
+      error = element_index(var->value.array, &stack[sp], count, &index);
+      if (error)
+        VM_ERROR(error);
+      set_integer(&stack[sp++], index);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_LOAD_ELEMENT_NUMBER): {
+      const double *elements = vars[code[pc++]]->value.array->elements;
+      set_number(&stack[sp - 1], elements[value_integer(stack[sp - 1])]);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_LOAD_ELEMENT_INTEGER): {
+      const int32_t *elements = vars[code[pc++]]->value.array->elements;
+      set_integer(&stack[sp - 1], elements[value_integer(stack[sp - 1])]);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_LOAD_ELEMENT_STRING): {
+      const Value *elements = vars[code[pc++]]->value.array->elements;
+      stack[sp - 1] = elements[value_integer(stack[sp - 1])];
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_STORE_ELEMENT_NUMBER): {
+      double *elements = vars[code[pc++]]->value.array->elements;
+      sp -= 2;
+      elements[value_integer(stack[sp])] = stack[sp + 1].number;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_STORE_ELEMENT_INTEGER): {
+      int32_t *elements = vars[code[pc++]]->value.array->elements;
+      Value *v = &stack[--sp];
+      if (!value_is_integer(*v) &&
+          (error = apply_op(OP_TO_INTEGER, 0, v, NULL)) != NULL)
+        VM_ERROR(error);
+      elements[value_integer(stack[--sp])] = value_integer(*v);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_STORE_ELEMENT_STRING): {
+      Value *elements = vars[code[pc++]]->value.array->elements;
+      sp -= 2;
+      elements[value_integer(stack[sp])] = stack[sp + 1];
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_TO_NUMBER):
+    VM_CASE(OP_TO_INTEGER):
+      error = apply_op(op, 0, &stack[sp - 1 - code[pc++]], NULL);
+      if (error)
+        VM_ERROR(error);
+      VM_NEXT;
+
+    VM_CASE(OP_ADD):
+      sp--;
+      stack[sp - 1].number += stack[sp].number;
+      VM_NEXT;
+
+    VM_CASE(OP_SUBTRACT):
+      sp--;
+      stack[sp - 1].number -= stack[sp].number;
+      VM_NEXT;
+
+    VM_CASE(OP_MULTIPLY):
+      sp--;
+      stack[sp - 1].number *= stack[sp].number;
+      VM_NEXT;
+
+    VM_CASE(OP_NEGATE):
+      stack[sp - 1].number = -stack[sp - 1].number;
+      VM_NEXT;
+
+    VM_CASE(OP_ADD_INT):
+    VM_CASE(OP_SUBTRACT_INT): {
+      Value *a = &stack[sp - 2];
+      Value *b = &stack[--sp];
+      if (value_is_integer(*a) && value_is_integer(*b)) {
+        int64_t i = value_integer(*a), j = value_integer(*b);
+        int64_t result = op == OP_ADD_INT ? i + j : i - j;
+        if (result >= INT32_MIN && result <= INT32_MAX) {
+          set_integer(a, (int32_t)result);
+          VM_NEXT;
+        }
+      }
+      apply_op(op, 0, a, b);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_COMPARE_INT): {
+      Value *a = &stack[sp - 2];
+      Value *b = &stack[--sp];
+      if (value_is_integer(*a) && value_is_integer(*b)) {
+        int32_t i = value_integer(*a), j = value_integer(*b);
+        set_integer(a, compare(code[pc++], (i > j) - (i < j)) ? -1 : 0);
+      } else {
+        apply_op(op, code[pc++], a, b);
+      }
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_EQUAL):
+    VM_CASE(OP_NOT_EQUAL):
+    VM_CASE(OP_LESS):
+    VM_CASE(OP_GREATER):
+    VM_CASE(OP_LESS_EQUAL):
+    VM_CASE(OP_GREATER_EQUAL):
+    VM_CASE(OP_MULTIPLY_INT):
+    VM_CASE(OP_AND):
+    VM_CASE(OP_OR):
+    VM_CASE(OP_DIVIDE):
+    VM_CASE(OP_POWER):
+      sp--;
+      error = apply_op(op, 0, &stack[sp - 1], &stack[sp]);
+      if (error)
+        VM_ERROR(error);
+      VM_NEXT;
+
+    VM_CASE(OP_NEGATE_INT):
+    VM_CASE(OP_NOT):
+    VM_CASE(OP_ABS):
+    VM_CASE(OP_INT):
+    VM_CASE(OP_SIN):
+    VM_CASE(OP_COS):
+    VM_CASE(OP_TAN):
+    VM_CASE(OP_SQR):
+      error = apply_op(op, 0, &stack[sp - 1], NULL);
+      if (error)
+        VM_ERROR(error);
+      VM_NEXT;
+
+    VM_CASE(OP_RND): {
+      double *x = &stack[sp - 1].number;
+      if (*x < 0) {
+        srand((unsigned)-*x);
+      }
+      *x = rand() / (RAND_MAX + 1.0);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_PEEK):
+      set_integer(&stack[sp - 1],
+                  interp->ram[(uint16_t)value_integer(stack[sp - 1])]);
+      VM_NEXT;
+
+    VM_CASE(OP_CONCAT): {
+      int count = code[pc++];
+      error = string_concat(interp, stack, sp, count);
+      if (error)
+        VM_ERROR(error);
+      sp -= count - 1;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_STRING_COMPARE): {
+      Value *b = &stack[--sp];
+      Value *a = &stack[sp - 1];
+      int cmp = string_compare(string_get(&interp->strings, *a),
+                               string_get(&interp->strings, *b));
+      set_integer(a, compare(code[pc++], cmp) ? -1 : 0);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_LEN):
+      set_integer(&stack[sp - 1], string_length(stack[sp - 1]));
+      VM_NEXT;
+
+    VM_CASE(OP_ASC): {
+      String s = string_get(&interp->strings, stack[sp - 1]);
+      if (s.length == 0)
+        VM_ERROR("ILLEGAL QUANTITY");
+      set_integer(&stack[sp - 1], (unsigned char)s.chars[0]);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_VAL): {
+      /* The number at the start after any spaces. strtod() needs the
+       * characters terminated, and is only shown those a BASIC number is
+       * written with. */
+      String s = string_get(&interp->strings, stack[sp - 1]);
+      int32_t start = 0;
+      while (start < s.length && s.chars[start] == ' ') {
+        start++;
+      }
+      int32_t end = start;
+      while (end < s.length && s.chars[end] &&
+             strchr(NUMBER_CHARS, s.chars[end])) {
+        end++;
+      }
+      size_t length = (size_t)(end - start);
+      char buf[64];
+      char *text = length < sizeof(buf) ? buf : safe_malloc(length + 1);
+      if (!text)
+        VM_ERROR("OUT OF MEMORY");
+      memcpy(text, s.chars + start, length);
+      text[length] = '\0';
+      set_number(&stack[sp - 1], strtod(text, NULL));
+      if (text != buf) {
+        safe_free(text);
+      }
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_CHR):
+    VM_CASE(OP_STR): {
+      Value *a = &stack[sp - 1];
+      char buf[32];
+      int length = 1;
+      if (op == OP_CHR) {
+        int32_t c = value_integer(*a);
+        if (c < 0 || c > 255)
+          VM_ERROR("ILLEGAL QUANTITY");
+        buf[0] = (char)c;
+      } else {
+        length = snprintf(buf, sizeof(buf), "%g", a->number);
+      }
+      if (!new_string(interp, stack, sp - 1, buf, length))
+        VM_ERROR("OUT OF MEMORY");
+      VM_NEXT;
+    }
+
+    /* Substrings share the characters of the operand */
+    VM_CASE(OP_LEFT):
+    VM_CASE(OP_RIGHT): {
+      int32_t n = value_integer(stack[--sp]);
+      Value *s = &stack[sp - 1];
+      int32_t length = string_length(*s);
+      if (n < 0)
+        VM_ERROR("ILLEGAL QUANTITY");
+      if (n < length) {
+        *s = string_part(*s, op == OP_RIGHT ? length - n : 0, n);
+      }
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_MID): {
+      int32_t n = value_integer(stack[--sp]);
+      int32_t start = value_integer(stack[--sp]);
+      Value *s = &stack[sp - 1];
+      int32_t length = string_length(*s);
+      if (start < 1 || n < 0)
+        VM_ERROR("ILLEGAL QUANTITY");
+      int32_t from = start - 1 < length ? start - 1 : length;
+      length -= from;
+      *s = string_part(*s, from, n < length ? n : length);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_ER):
+      set_integer(&stack[sp++], interp->error_number);
+      VM_NEXT;
+
+    VM_CASE(OP_EL):
+      set_integer(&stack[sp++], interp->error_line);
+      VM_NEXT;
+
+    VM_CASE(OP_PRINT_NUMBER): {
+      Value *v = &stack[--sp];
+      if (value_is_integer(*v)) {
+        basic_print(interp, "%d", (int)value_integer(*v));
+      } else {
+        basic_print(interp, "%g", v->number);
+      }
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_PRINT_STRING):
+      print_string(interp, string_get(&interp->strings, stack[--sp]));
+      VM_NEXT;
+
+    VM_CASE(OP_PRINT_TAB):
+      basic_print(interp, "\t");
+      VM_NEXT;
+
+    VM_CASE(OP_PRINT_NEWLINE):
+      basic_print(interp, "\n");
+      VM_NEXT;
+
+    VM_CASE(OP_JUMP): {
+      int target = code[pc];
+      pc = target < pc && pc < traced
+               ? back_edge(interp, back_edges, pc - 1, target)
+               : target;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_JUMP_IF_FALSE):
+    VM_CASE(OP_JUMP_IF_TRUE): {
+      Value *v = &stack[--sp];
+      bool truth =
+          value_is_integer(*v) ? value_integer(*v) != 0 : v->number != 0;
+      if (truth != (op == OP_JUMP_IF_TRUE)) {
+        pc++;
+        VM_NEXT;
+      }
+      int target = code[pc];
+      pc = target < pc && pc < traced
+               ? back_edge(interp, back_edges, pc - 1, target)
+               : target;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_GOTO):
+    VM_CASE(OP_GOSUB): {
+      ProgramLine *target =
+          program_find_line(interp, value_integer(stack[--sp]));
+      if (!target)
+        VM_ERROR("LINE NOT FOUND");
+      if (op == OP_GOSUB && !stack_push(interp, pc))
+        goto trap;
+      pc = target->code_offset;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_CALL):
+      if (!stack_push(interp, pc + 1))
+        goto trap;
+      pc = code[pc];
+      VM_NEXT;
+
+    VM_CASE(OP_RETURN): {
+      int return_pc = stack_pop(interp);
+      if (interp->error_occurred)
+        goto trap;
+      pc = return_pc;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_ON_GOTO):
+    VM_CASE(OP_ON_GOSUB): {
+      int32_t index = value_integer(stack[--sp]);
+      int count = code[pc];
+      int next = pc + 1 + count;
+      if (index < 0)
+        VM_ERROR("ILLEGAL QUANTITY");
+      /* Out of range selects no target and falls through */
+      if (index == 0 || index > count) {
+        pc = next;
+        VM_NEXT;
+      }
+      int target = code[pc + index];
+      if (target < 0)
+        VM_ERROR("LINE NOT FOUND");
+      if (op == OP_ON_GOSUB && !stack_push(interp, next))
+        goto trap;
+      pc = target;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_READ): {
+      if (interp->data_pointer >= bc->data_count)
+        VM_ERROR("OUT OF DATA");
+      const DataItem *item = &bc->data[interp->data_pointer++];
+      if (code[pc++]) {
+        stack[sp++] = bc->strings[item->string];
+      } else {
+        if (!item->is_number)
+          VM_ERROR("SYNTAX");
+        set_number(&stack[sp++], item->number);
+      }
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_RESTORE): {
+      int line_number = code[pc++];
+      if (line_number < 0) {
+        interp->data_pointer = 0;
+        VM_NEXT;
+      }
+      ProgramLine *line = program_find_line(interp, line_number);
+      if (!line)
+        VM_ERROR("LINE NOT FOUND");
+      interp->data_pointer = line->data_index;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_TRAP):
+      interp->trap_line = code[pc++];
+      VM_NEXT;
+
+    VM_CASE(OP_RESUME): {
+      int mode = code[pc++];
+      if (!interp->trapped ||
+          (mode != RESUME_LINE && interp->resume_pc < 0))
+        VM_ERROR("CAN'T RESUME");
+      interp->trapped = false;
+      if (mode != RESUME_LINE) {
+        interp->current_line = interp->resume_line;
+        pc = mode == RESUME_RETRY ? interp->resume_pc
+                                  : interp->resume_next_pc;
+      }
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_FOR): {
+      Variable *var = vars[code[pc++]];
+      /* A loop already open on the variable is restarted, dropping the
+       * loops inside it */
+      int depth = interp->for_depth;
+      while (depth > 0 && interp->for_stack[depth - 1].var != var) {
+        depth--;
+      }
+      depth = depth > 0 ? depth - 1 : interp->for_depth;
+      if (depth == MAX_FOR_DEPTH)
+        VM_ERROR("OUT OF MEMORY");
+
+      ForLoop *loop = &interp->for_stack[depth];
+      interp->for_depth = depth + 1;
+      loop->var = var;
+      sp -= 2;
+      if (var->type == VAR_INTEGER) {
+        loop->integer_limit = value_integer(stack[sp]);
+        loop->integer_step = value_integer(stack[sp + 1]);
+      } else {
+        loop->limit = stack[sp].number;
+        loop->step = stack[sp + 1].number;
+      }
+      loop->body_pc = pc;
+      loop->line = interp->current_line;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_NEXT): {
+      int slot = code[pc++];
+      int depth = interp->for_depth;
+      if (slot >= 0) {
+        while (depth > 0 && interp->for_stack[depth - 1].var != vars[slot]) {
+          depth--;
+        }
+      }
+      if (depth == 0)
+        VM_ERROR("NEXT WITHOUT FOR");
+
+      ForLoop *loop = &interp->for_stack[depth - 1];
+      Variable *var = loop->var;
+      bool again;
+      if (var->type == VAR_INTEGER) {
+        int64_t value = (int64_t)var->value.integer + loop->integer_step;
+        again = loop->integer_step >= 0 ? value <= loop->integer_limit
+                                        : value >= loop->integer_limit;
+        if (value >= INT32_MIN && value <= INT32_MAX) {
+          var->value.integer = (int32_t)value;
+        }
+      } else {
+        double value = var->value.number + loop->step;
+        var->value.number = value;
+        again = loop->step >= 0 ? value <= loop->limit : value >= loop->limit;
+      }
+
+      if (!again) {
+        interp->for_depth = depth - 1;
+        VM_NEXT;
+      }
+      /* Loops inside a single line never reach OP_LINE */
+      if (interp->break_requested) {
+        basic_print(interp, "\n? BREAK\n");
+        interp->break_requested = false;
+        goto done;
+      }
+      interp->for_depth = depth;
+      interp->current_line = loop->line;
+      pc = pc - 2 < traced
+               ? back_edge(interp, back_edges, pc - 2, loop->body_pc)
+               : loop->body_pc;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_MARK_FOR):
+      vars[code[pc++]]->value.integer = interp->for_depth;
+      VM_NEXT;
+
+    VM_CASE(OP_DROP_FOR): {
+      int depth = vars[code[pc++]]->value.integer;
+      if (interp->for_depth > depth) {
+        interp->for_depth = depth;
+      }
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_POKE): {
+      int32_t value = value_integer(stack[--sp]);
+      int32_t address = value_integer(stack[--sp]);
+      poke(interp, (uint16_t)address, (uint8_t)value);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_PLOT):
+    VM_CASE(OP_DRAW): {
+      double y = stack[--sp].number;
+      double x = stack[--sp].number;
+      if (op == OP_DRAW) {
+        draw_line(interp, (int)interp->graphics_x, (int)interp->graphics_y,
+                  (int)x, (int)y);
+      }
+      interp->graphics_x = x;
+      interp->graphics_y = y;
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_CLR):
+      if (interp->editor) {
+        editor_clear(interp->editor);
+      } else {
+        clear_screen();
+      }
+      VM_NEXT;
+
+    VM_CASE(OP_MEMCHK): {
+      char mem_buf[256];
+      format_memory_size(mem_buf, get_free_memory(), total_memory_limit);
+      for (int i = 0; mem_buf[i]; i++) {
+        mem_buf[i] = toupper((unsigned char)mem_buf[i]);
+      }
+      basic_print(interp, "%s\n", mem_buf);
+      VM_NEXT;
+    }
+
+    VM_CASE(OP_ERROR):
+      VM_ERROR(string_get(&interp->strings, bc->strings[code[pc]]).chars);
+
+    VM_CASE(OP_EXIT):
+      interp->exit_requested = true;
+      goto done;
+
+    VM_CASE(OP_END):
+      goto done;
+    }
+    continue;
+
+  trap:
+    /* Only raised errors get here, so TRAP costs nothing until then */
+    if ((pc = trap_error(interp, pc - 1)) < 0)
+      goto done;
+    sp = 0;
+  }
+
+done:
+  interp->running = false;
+}
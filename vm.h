@@ -0,0 +1,14 @@
+#ifndef VM_H
+#define VM_H
+
+#include "interpreter.h"
+
+/* Execute compiled code starting at pc until END, an error or BREAK */
+void vm_run(Interpreter *interp, int pc);
+
+/* Apply a numeric instruction with operand word arg to constant
+ * operands, for constant folding. Returns false if the operation would
+ * raise an error, which is then left to happen at run time. */
+bool vm_fold(int op, int arg, const Value *operands, int count, Value *result);
+
+#endif /* VM_H */